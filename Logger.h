@@ -1,8 +1,14 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
 #include <codecvt>
+#include <algorithm>
 #include <condition_variable>
+#include <filesystem>
 #include <fstream>
+#include <functional>
+#include <iomanip>
 #include <iostream>
 #include <locale>
 #include <memory>
@@ -11,52 +17,71 @@
 #include <queue>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <unordered_map>
 #include <vector>
 
+#include "Loggy.h"
+#include "LoggyStats.h"
+
 #ifdef _WIN32
 #include <windows.h>
+#include <io.h>
 #endif
 
+#include <errno.h>
+#include <fcntl.h>
+
+#include <ctype.h>
+#include <math.h>
+#include <stdlib.h>
 #include <string.h>
 
-#define LOGL(level, msg)                                                                           \
-    if (Loggy::isLevel(level)) {                                                                   \
-        Loggy::writer(level, __FILE__, __LINE__) << msg;                                           \
-        Loggy::queue();                                                                            \
-    }
+#if defined(__has_include)
+#if __has_include(<execinfo.h>) && __has_include(<dlfcn.h>)
+#include <dlfcn.h>
+#include <execinfo.h>
+#define _LOGGY_BACKTRACE
+#endif
+#if __has_include(<cxxabi.h>)
+#include <cxxabi.h>
+#define _LOGGY_DEMANGLE
+#endif
+#endif
 
-#define LOG_FLUSH()                                                                                \
-    {                                                                                              \
-        Loggy::wait_queues();                                                                      \
-    }
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define _LOGGY_SSE2
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#define _LOGGY_AVX2
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define _LOGGY_RETURN_ADDRESS() _ReturnAddress()
+#else
+#define _LOGGY_RETURN_ADDRESS() __builtin_return_address(0)
+#endif
 
-#define LOGT(msg) LOGL(Loggy::LTRACE, msg)
-#define LOGD(msg) LOGL(Loggy::LDEBUG, msg)
-#define LOGI(msg) LOGL(Loggy::LINFO, msg)
-#define LOGE(msg) LOGL(Loggy::LERROR, msg)
+#ifndef _WIN32
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#endif
 
 namespace Loggy {
     using namespace std;
 
-    constexpr int DEFAULT_BUF_CNT = 1000;
-    constexpr const char* DEFAULT_TIME_FMT = "%Y%m%d.%H%M%S";
-    constexpr double DROP_NOTIFY_SECONDS = 5.0;
-    constexpr double FLUSH_SECONDS = 1.0;
-
-    enum {
-        LINVALID = 0,
-        LTRACE = 9,
-        LDEBUG = 10,
-        LINFO = 20,
-        LERROR = 40,
-        LWARN = 30,
-        LCRITICAL = 50,
-        LMAX = 50,
-    };
-
-    unordered_map<int, string> levelNames_ = {
+    inline unordered_map<int, string> levelNames_ = {
         { LINVALID, "INVALID" },
         { LTRACE, "TRACE" },
         { LDEBUG, "DEBUG" },
@@ -66,7 +91,70 @@ namespace Loggy {
         { LCRITICAL, "CRITICAL" },
     };
 
-    wstring str2w(const string& in)
+    inline const char* levelName(int level)
+    {
+        auto it = levelNames_.find(level);
+        return it == levelNames_.end() ? "" : it->second.c_str();
+    }
+
+    inline const char* baseName(const char* file)
+    {
+        const char* b = strrchr(file, '\\');
+        if (!b)
+            b = strrchr(file, '/');
+        return b ? b + 1 : file;
+    }
+
+    // Shell-style match of * and ?, where * also matches '/'.
+    inline bool globMatch(const char* pattern, const char* text)
+    {
+        const char* star = nullptr;
+        const char* resume = nullptr;
+        while (*text) {
+            if (*pattern == '*') {
+                star = pattern++;
+                resume = text;
+            }
+            else if (*pattern == '?' || *pattern == *text) {
+                ++pattern;
+                ++text;
+            }
+            else if (star) {
+                pattern = star + 1;
+                text = ++resume;
+            }
+            else {
+                return false;
+            }
+        }
+        while (*pattern == '*') {
+            ++pattern;
+        }
+        return !*pattern;
+    }
+
+    inline uint64_t threadId()
+    {
+#if defined(_WIN32)
+        thread_local uint64_t id = GetCurrentThreadId();
+#elif defined(__linux__)
+        thread_local uint64_t id = (uint64_t)syscall(SYS_gettid);
+#else
+        thread_local uint64_t id = hash<thread::id>()(this_thread::get_id());
+#endif
+        return id;
+    }
+
+    inline uint64_t processId()
+    {
+#ifdef _WIN32
+        return GetCurrentProcessId();
+#else
+        return (uint64_t)getpid();
+#endif
+    }
+
+    inline wstring str2w(const string& in)
     {
 #ifdef _WIN32
         if (in.empty())
@@ -81,7 +169,7 @@ namespace Loggy {
 #endif
     }
 
-    string w2str(const wstring& in)
+    inline string w2str(const wstring& in)
     {
 #ifdef _WIN32
         if (in.empty())
@@ -97,6 +185,232 @@ namespace Loggy {
 #endif
     }
 
+    // Resolves symlinks and dot segments as far as the path exists, so different spellings
+    // of one file compare equal.  Falls back to the path as given.
+    inline wstring canonicalPath(const wstring& path)
+    {
+        error_code ec;
+#ifdef _WIN32
+        auto p = filesystem::weakly_canonical(filesystem::path(path), ec);
+        return ec ? path : p.wstring();
+#else
+        auto p = filesystem::weakly_canonical(filesystem::path(w2str(path)), ec);
+        return ec ? path : str2w(p.string());
+#endif
+    }
+
+
+#ifdef LOGGY_LOCK_PROFILE
+    // Lock contention profiling, enabled by defining LOGGY_LOCK_PROFILE before including
+    // this header.  Every thread accumulates into its own counters, so recording never
+    // contends; profileStats() sums them on demand.
+
+    enum {
+        PROF_LOG_MUTEX = 0,  // Log::mutex_
+        PROF_QUEUE_MUTEX,    // SafeQueue::m
+        PROF_WRITER,         // producer time spent in Log::writer
+        PROF_QUEUE,          // producer time spent in Log::queue
+        PROF_MAX,
+    };
+
+    inline const char* profNames_[PROF_MAX] = {
+        "log_mutex",
+        "queue_mutex",
+        "writer",
+        "queue",
+    };
+
+    struct ProfileStats {
+        const char* name = "";
+        uint64_t count = 0;
+        uint64_t waitNs = 0;
+        uint64_t maxWaitNs = 0;
+        uint64_t holdNs = 0;
+        uint64_t maxHoldNs = 0;
+    };
+
+    class Profiler {
+    public:
+        struct Counter {
+            // only the owning thread writes, readers tolerate relaxed values
+            atomic<uint64_t> count { 0 };
+            atomic<uint64_t> waitNs { 0 };
+            atomic<uint64_t> maxWaitNs { 0 };
+            atomic<uint64_t> holdNs { 0 };
+            atomic<uint64_t> maxHoldNs { 0 };
+
+            static void add(atomic<uint64_t>& a, uint64_t v)
+            {
+                a.store(a.load(memory_order_relaxed) + v, memory_order_relaxed);
+            }
+
+            static void max(atomic<uint64_t>& a, uint64_t v)
+            {
+                if (v > a.load(memory_order_relaxed))
+                    a.store(v, memory_order_relaxed);
+            }
+
+            void wait(uint64_t ns)
+            {
+                add(count, 1);
+                add(waitNs, ns);
+                max(maxWaitNs, ns);
+            }
+
+            void hold(uint64_t ns)
+            {
+                add(holdNs, ns);
+                max(maxHoldNs, ns);
+            }
+        };
+
+        struct Thread {
+            Counter counters[PROF_MAX];
+        };
+
+        static Profiler& get()
+        {
+            // never destroyed: worker threads may still record while statics are torn down
+            static Profiler* p = new Profiler;
+            return *p;
+        }
+
+        static Counter& counter(int site)
+        {
+            thread_local shared_ptr<Thread> t = get().registerThread();
+            return t->counters[site];
+        }
+
+        static uint64_t now()
+        {
+            return chrono::duration_cast<chrono::nanoseconds>(
+                chrono::steady_clock::now().time_since_epoch())
+                .count();
+        }
+
+        vector<ProfileStats> stats()
+        {
+            vector<ProfileStats> ret(PROF_MAX);
+            lock_guard<mutex> lock(m_);
+            for (int i = 0; i < PROF_MAX; ++i) {
+                ret[i].name = profNames_[i];
+                for (auto& t : threads_) {
+                    auto& c = t->counters[i];
+                    ret[i].count += c.count.load(memory_order_relaxed);
+                    ret[i].waitNs += c.waitNs.load(memory_order_relaxed);
+                    ret[i].holdNs += c.holdNs.load(memory_order_relaxed);
+                    ret[i].maxWaitNs
+                        = (std::max<uint64_t>)(ret[i].maxWaitNs, c.maxWaitNs.load(memory_order_relaxed));
+                    ret[i].maxHoldNs
+                        = (std::max<uint64_t>)(ret[i].maxHoldNs, c.maxHoldNs.load(memory_order_relaxed));
+                }
+            }
+            return ret;
+        }
+
+        void reset()
+        {
+            lock_guard<mutex> lock(m_);
+            for (auto& t : threads_) {
+                for (auto& c : t->counters) {
+                    c.count = 0;
+                    c.waitNs = 0;
+                    c.maxWaitNs = 0;
+                    c.holdNs = 0;
+                    c.maxHoldNs = 0;
+                }
+            }
+        }
+
+    private:
+        shared_ptr<Thread> registerThread()
+        {
+            // counters outlive their thread so totals stay complete
+            auto t = make_shared<Thread>();
+            lock_guard<mutex> lock(m_);
+            threads_.push_back(t);
+            return t;
+        }
+
+        mutex m_;
+        vector<shared_ptr<Thread>> threads_;
+    };
+
+    // Drop-in mutex recording how long lock() waited and how long the lock was held.
+    template <int Site> class ProfiledMutex {
+    public:
+        void lock()
+        {
+            auto t0 = Profiler::now();
+            m_.lock();
+            acquired_ = Profiler::now();
+            Profiler::counter(Site).wait(acquired_ - t0);
+        }
+
+        bool try_lock()
+        {
+            if (!m_.try_lock())
+                return false;
+            acquired_ = Profiler::now();
+            Profiler::counter(Site).wait(0);
+            return true;
+        }
+
+        void unlock()
+        {
+            auto held = Profiler::now() - acquired_;
+            m_.unlock();
+            Profiler::counter(Site).hold(held);
+        }
+
+    private:
+        mutex m_;
+        uint64_t acquired_ = 0;
+    };
+
+    // Records the time spent in a producer-side scope as hold time of its site.
+    class ProfileScope {
+    public:
+        ProfileScope(int site)
+            : site_(site)
+            , start_(Profiler::now())
+        {
+            Profiler::counter(site_).wait(0);
+        }
+
+        ~ProfileScope() { Profiler::counter(site_).hold(Profiler::now() - start_); }
+
+    private:
+        int site_;
+        uint64_t start_;
+    };
+
+    inline vector<ProfileStats> profileStats() { return Profiler::get().stats(); }
+
+    inline void profileReset() { Profiler::get().reset(); }
+
+    inline void profileReport(wostream& os)
+    {
+        os << "site          calls     wait_ns   max_wait_ns     hold_ns   max_hold_ns" << endl;
+        for (auto& s : profileStats()) {
+            os << left << setw(12) << s.name << right << setw(8) << s.count << setw(12)
+               << s.waitNs << setw(14) << s.maxWaitNs << setw(12) << s.holdNs << setw(14)
+               << s.maxHoldNs << endl;
+        }
+    }
+
+    using LogMutex = ProfiledMutex<PROF_LOG_MUTEX>;
+    using QueueMutex = ProfiledMutex<PROF_QUEUE_MUTEX>;
+    using QueueCondition = condition_variable_any;
+
+#define _LOGGY_PROFILE_SCOPE(site) Loggy::ProfileScope _loggy_profile_scope(site)
+#else
+    using LogMutex = mutex;
+    using QueueMutex = mutex;
+    using QueueCondition = condition_variable;
+
+#define _LOGGY_PROFILE_SCOPE(site)
+#endif
 
     template <class T> class SafeQueue {
     public:
@@ -108,13 +422,14 @@ namespace Loggy {
         {
         }
 
-        ~SafeQueue(void) { lock_guard<mutex> lock(m); }
+        ~SafeQueue(void) { lock_guard<QueueMutex> lock(m); }
 
         // Add an element to the queue.
         void push(T t)
         {
-            lock_guard<mutex> lock(m);
-            q.push(t);
+            lock_guard<QueueMutex> lock(m);
+            q.push(std::move(t));
+            n.store(q.size(), memory_order_relaxed);
             c.notify_one();
         }
 
@@ -122,7 +437,7 @@ namespace Loggy {
         // If the queue is empty, wait till a element is avaiable.
         T pop(void)
         {
-            unique_lock<mutex> lock(m);
+            unique_lock<QueueMutex> lock(m);
             while (!x && q.empty()) {
                 // release lock as long as the wait and reaquire it afterwards.
                 c.wait(lock);
@@ -132,8 +447,10 @@ namespace Loggy {
                 return T();
             };
 
-            T val = q.front();
+            T val = std::move(q.front());
             q.pop();
+            n.store(q.size(), memory_order_relaxed);
+            b = true;
 
             if (q.empty()) {
                 c.notify_all();
@@ -141,39 +458,119 @@ namespace Loggy {
             return val;
         }
 
-        size_t size() { return q.size(); }
+        // Like pop(), but returns false instead of an empty element on quit.
+        bool pop(T& val)
+        {
+            unique_lock<QueueMutex> lock(m);
+            while (!x && q.empty()) {
+                c.wait(lock);
+            }
+
+            if (x) {
+                return false;
+            };
+
+            val = std::move(q.front());
+            q.pop();
+            n.store(q.size(), memory_order_relaxed);
+            b = true;
+
+            if (q.empty()) {
+                c.notify_all();
+            }
+            return true;
+        }
+
+        // Takes the front element if there is one, without waiting.
+        bool tryPop(T& val)
+        {
+            lock_guard<QueueMutex> lock(m);
+            if (x || q.empty()) {
+                return false;
+            }
+            val = std::move(q.front());
+            q.pop();
+            n.store(q.size(), memory_order_relaxed);
+            b = true;
+            return true;
+        }
+
+        // Like pop(), but gives up at the deadline.  Returns false on timeout or quit.
+        template <class TimePoint> bool pop(T& val, const TimePoint& deadline)
+        {
+            unique_lock<QueueMutex> lock(m);
+            while (!x && q.empty()) {
+                if (c.wait_until(lock, deadline) == cv_status::timeout && q.empty()) {
+                    return false;
+                }
+            }
+
+            if (x) {
+                return false;
+            };
+
+            val = std::move(q.front());
+            q.pop();
+            n.store(q.size(), memory_order_relaxed);
+            b = true;
+
+            if (q.empty()) {
+                c.notify_all();
+            }
+            return true;
+        }
+
+        // Lock-free, so producers can check the bound cheaply; may be momentarily stale.
+        size_t size() { return n.load(memory_order_relaxed); }
+
+        // The consumer has finished with the element it popped last.
+        void done(void)
+        {
+            lock_guard<QueueMutex> lock(m);
+            b = false;
+            if (q.empty()) {
+                c.notify_all();
+            }
+        }
 
+        // Wait till the queue is empty and the consumer is done with the last element.
         void join(void)
         {
-            unique_lock<mutex> lock(m);
-            while (!q.empty()) {
+            unique_lock<QueueMutex> lock(m);
+            while (!x && (!q.empty() || b)) {
                 c.wait(lock);
             }
         }
 
         size_t drain(void)
         {
-            unique_lock<mutex> lock(m);
+            unique_lock<QueueMutex> lock(m);
             std::queue<T> empty;
             swap(q, empty);
+            n.store(0, memory_order_relaxed);
             c.notify_all();
             return empty.size();
         }
 
         size_t quit()
         {
-            x = true;
+            {
+                lock_guard<QueueMutex> lock(m);
+                x = true;
+            }
             return drain();
         }
 
     private:
-        queue<T> q;
-        mutable mutex m;
-        condition_variable c;
+        std::queue<T> q;
+        mutable QueueMutex m;
+        QueueCondition c;
         bool x;
+        bool b = false;  // the consumer is busy with a popped element
+        atomic<size_t> n { 0 };
     };
 
-    static string timestamp(const char format[], const time_t& rawtime)
+    inline string timestamp(const char format[], const time_t& rawtime)
     {
         struct tm timeinfo;
         char buffer[120];
@@ -187,164 +584,2831 @@ namespace Loggy {
         return string(buffer);
     }
 
-#ifdef _WIN32
-#define _LOGGY_CVT_FILENAME(s) s
-#else
-#define _LOGGY_CVT_FILENAME(s) Loggy::w2str(s)
-#endif
-
-    class Output {
-        SafeQueue<wstring> queue_;  // this should be first
-        wofstream fstream_;
-        wostream& wstream_;
-        size_t max_;
-        int level_;
-        size_t dropped_ = 0;
-        bool alive_ = true;
-        time_t firstDrop_ = 0;
-
-        std::thread thread_;  // this must be last
-
-    public:
-        Output(wostream& s, int level, int max)
-            : wstream_(s)
-            , level_(level)
-            , max_(max)
-            , thread_(&Output::worker, this)
-        {
-        }
-
-        Output(const wstring& s, int level, size_t max)
-            : fstream_(_LOGGY_CVT_FILENAME(s), std::wofstream::out | std::wofstream::app)
-            , wstream_(fstream_)
-            , level_(level)
-            , max_(max)
-            , thread_(&Output::worker, this)
-        {
-        }
-
-        ~Output()
-        {
-            alive_ = false;
-            dropped_ += queue_.quit();
-            if (dropped_) {
-                logDropped();
-            }
-            thread_.join();
+    // Breaks seconds since the epoch into a UTC struct tm (H. Hinnant's civil_from_days).
+    inline struct tm utcTime(int64_t seconds)
+    {
+        static const int monthDays[] = { 0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334 };
+        struct tm t = {};
+        int64_t days = seconds / 86400;
+        int64_t rem = seconds % 86400;
+        if (rem < 0) {
+            rem += 86400;
+            --days;
         }
+        t.tm_hour = (int)(rem / 3600);
+        t.tm_min = (int)(rem % 3600 / 60);
+        t.tm_sec = (int)(rem % 60);
+        t.tm_wday = (int)(((days + 4) % 7 + 7) % 7);  // 1970-01-01 was a Thursday
 
-        void wait() { queue_.join(); wstream_.flush(); }
+        days += 719468;
+        int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+        unsigned doe = (unsigned)(days - era * 146097);
+        unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+        unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+        unsigned mp = (5 * doy + 2) / 153;
+        unsigned mon = mp < 10 ? mp + 3 : mp - 9;
+        int64_t year = (int64_t)yoe + era * 400 + (mon <= 2);
+        bool leap = (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
 
-        void logDropped()
-        {
-            wstringstream ws;
-            time_t t;
-            time(&t);
-            ws << Loggy::timestamp(DEFAULT_TIME_FMT, t).c_str();
-            ws << " dropped " << dropped_ << " entries";
-            queue_.push(ws.str());
-            dropped_ = 0;
-        }
+        t.tm_mday = (int)(doy - (153 * mp + 2) / 5 + 1);
+        t.tm_mon = (int)mon - 1;
+        t.tm_year = (int)(year - 1900);
+        t.tm_yday = monthDays[t.tm_mon] + t.tm_mday - 1 + (leap && mon > 2);
+        return t;
+    }
 
-        void add(wstring& str, time_t& t)
-        {
-            if (alive_) {
-                if (max_ == 0 || queue_.size() < max_) {
-                    queue_.push(str);
-                }
-                else {
-                    ++dropped_;
-                    if (dropped_ == 1) {
-                        firstDrop_ = t;
-                    }
-                    else if (difftime(t, firstDrop_) > DROP_NOTIFY_SECONDS) {
-                        logDropped();
-                    }
-                }
+    // Renders an strftime-style format for a UTC time into buf without allocating.  The
+    // numeric fields are written directly; anything else is delegated to strftime.
+    inline size_t utcTimestamp(char* buf, size_t size, const char* format, int64_t seconds)
+    {
+        struct tm t = utcTime(seconds);
+        size_t n = 0;
+        auto put = [&](int v, int width) {
+            char digits[12];
+            int d = 0;
+            do {
+                digits[d++] = (char)('0' + v % 10);
+                v /= 10;
+            } while (v);
+            while (d < width)
+                digits[d++] = '0';
+            while (d && n + 1 < size)
+                buf[n++] = digits[--d];
+        };
+        for (const char* f = format; *f && n + 1 < size; ++f) {
+            if (*f != '%' || !f[1]) {
+                buf[n++] = *f;
+                continue;
+            }
+            switch (*++f) {
+            case 'Y': put(t.tm_year + 1900, 4); break;
+            case 'y': put(t.tm_year % 100, 2); break;
+            case 'm': put(t.tm_mon + 1, 2); break;
+            case 'd': put(t.tm_mday, 2); break;
+            case 'H': put(t.tm_hour, 2); break;
+            case 'M': put(t.tm_min, 2); break;
+            case 'S': put(t.tm_sec, 2); break;
+            case 'j': put(t.tm_yday + 1, 3); break;
+            case 'F':
+                n += utcTimestamp(buf + n, size - n, "%Y-%m-%d", seconds);
+                break;
+            case 'T':
+                n += utcTimestamp(buf + n, size - n, "%H:%M:%S", seconds);
+                break;
+            case '%': buf[n++] = '%'; break;
+            default: {
+                char spec[3] = { '%', *f, 0 };
+                n += strftime(buf + n, size - n, spec, &t);
+                break;
             }
-        }
-
-        void worker()
-        {
-            int written = 0;
-            time_t lastFlush = 0;
-
-            while (alive_) {
-                if (!queue_.size() && written > 0) {
-                    time_t t;
-                    time(&t);
-                    if (difftime(t, lastFlush) > FLUSH_SECONDS) {
-                        wstream_.flush();
-                        lastFlush = t;
-                        written = 0;
-                    }
-                }
-                auto t = queue_.pop();
-                if (alive_) {
-                    wstream_ << t << std::endl;
-                    written += 1;
-                }
             }
         }
+        buf[n] = 0;
+        return n;
+    }
+
+    enum {
+        REC_TEXT = 0,  // a log statement, rendered through the output's layout
+        REC_RAW,       // a preformatted line, written as is
+        REC_SPAN,      // a LOG_SCOPE timing span
+        REC_STAT,      // a LOG_STAT sample
+        REC_GAP,       // stands for records an output dropped; value is their count
+        REC_FLUSH,     // has the worker flush what it has written, writes nothing
     };
 
-    class Log {
-    public:
-        ~Log() { resetOutput(); };
+    // A hexdump() argument of a statement, kept out of its message until an output writes it.
+    struct BlobRef {
+        size_t at;     // position in the message
+        size_t size;   // bytes kept in the record
+        size_t total;  // bytes passed to hexdump()
+    };
 
-        int level_ = LINFO;
-        int trigFrom_ = LINVALID;
-        int trigTo_ = LINVALID;
-        int trigCnt_ = LINVALID;
-        string timeFormat_ = DEFAULT_TIME_FMT;
-        mutex mutex_;
+    struct Record {
+        int kind = REC_TEXT;
+        int level = LINVALID;
+        int64_t ns = 0;  // system clock, nanoseconds since the epoch
+        const char* file = "";
+        int line = 0;
+        uint64_t tid = 0;
+        const char* name = "";  // span or metric name, a string literal
+        int64_t dur = 0;        // span duration in nanoseconds
+        double value = 0;       // metric sample
+        uint64_t seq = 0;       // position in the output's stream, set by its worker
+        wstring msg;
+        vector<void*> frames;  // return addresses, see setStackTraces()
+        string blob;           // the bytes of the statement's hexdump()s
+        vector<BlobRef> blobs;
 
-        deque<Output> outputs_;
-        Output default_output_;
+        time_t seconds() const { return (time_t)(ns / 1000000000); }
+    };
 
-        vector<wstring> buffer_;
+    inline chrono::steady_clock::duration steadyDuration(double seconds)
+    {
+        return chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(seconds));
+    }
 
-        Log()
-            : default_output_(wcout, LINFO, 1) {};
+    inline void appendAscii(wstring& out, const char* s)
+    {
+        while (*s)
+            out.push_back((wchar_t)(unsigned char)*s++);
+    }
 
-        bool isLevel(int level) { return level >= level_; }
+    inline void appendUInt(wstring& out, uint64_t v, int width = 0)
+    {
+        wchar_t buf[24];
+        int n = 0;
+        do {
+            buf[n++] = (wchar_t)(L'0' + v % 10);
+            v /= 10;
+        } while (v);
+        while (n < width)
+            buf[n++] = L'0';
+        while (n)
+            out.push_back(buf[--n]);
+    }
 
-        void resetOutput()
-        {
-            lock_guard<mutex> lock(mutex_);
-            outputs_.clear();
+    template <class C> inline void appendJson(wstring& out, const C* s)
+    {
+        for (; *s; ++s) {
+            auto c = (wchar_t)(typename make_unsigned<C>::type)*s;
+            if (c == L'"' || c == L'\\') {
+                out.push_back(L'\\');
+                out.push_back(c);
+            }
+            else if (c < 0x20) {
+                static const wchar_t hex[] = L"0123456789abcdef";
+                out += L"\\u00";
+                out.push_back(hex[c >> 4]);
+                out.push_back(hex[c & 15]);
+            }
+            else {
+                out.push_back(c);
+            }
         }
+    }
 
-        void addOutput(const wstring& path, int level, int bufferSize)
-        {
-            lock_guard<mutex> lock(mutex_);
-            outputs_.emplace_back(path, level, bufferSize);
-        }
+    // Appends nanoseconds as microseconds with three decimals, the trace_event time unit.
+    inline void appendMicros(wstring& out, int64_t ns)
+    {
+        appendUInt(out, (uint64_t)(ns / 1000));
+        out.push_back(L'.');
+        appendUInt(out, (uint64_t)(ns % 1000), 3);
+    }
 
-        void addOutput(wostream& stream, int level, int bufferSize)
-        {
-            lock_guard<mutex> lock(mutex_);
-            outputs_.emplace_back(stream, level, bufferSize);
-        }
+    inline void appendHex(wstring& out, uint64_t v)
+    {
+        wchar_t buf[16];
+        int n = 0;
+        do {
+            buf[n++] = L"0123456789abcdef"[v & 15];
+            v >>= 4;
+        } while (v);
+        while (n)
+            out.push_back(buf[--n]);
+    }
 
+#ifdef _LOGGY_SSE2
+    // Stores 16 ASCII characters as wchar_t.
+    inline void storeWide(wchar_t* w, __m128i c)
+    {
+#ifdef _LOGGY_AVX2
+        if (sizeof(wchar_t) == 4) {
+            _mm256_storeu_si256((__m256i*)w, _mm256_cvtepu8_epi32(c));
+            _mm256_storeu_si256((__m256i*)(w + 8), _mm256_cvtepu8_epi32(_mm_srli_si128(c, 8)));
+        }
+        else {
+            _mm256_storeu_si256((__m256i*)w, _mm256_cvtepu8_epi16(c));
+        }
+#else
+        const __m128i z = _mm_setzero_si128();
+        __m128i lo = _mm_unpacklo_epi8(c, z);
+        __m128i hi = _mm_unpackhi_epi8(c, z);
+        if (sizeof(wchar_t) == 4) {
+            _mm_storeu_si128((__m128i*)w, _mm_unpacklo_epi16(lo, z));
+            _mm_storeu_si128((__m128i*)(w + 4), _mm_unpackhi_epi16(lo, z));
+            _mm_storeu_si128((__m128i*)(w + 8), _mm_unpacklo_epi16(hi, z));
+            _mm_storeu_si128((__m128i*)(w + 12), _mm_unpackhi_epi16(hi, z));
+        }
+        else {
+            _mm_storeu_si128((__m128i*)w, lo);
+            _mm_storeu_si128((__m128i*)(w + 8), hi);
+        }
+#endif
+    }
+#endif
+
+    // Appends size bytes as lowercase hex, two digits per byte.  Encodes 16 bytes a step with
+    // SSE2, and widens the digits with AVX2 where the build targets it.
+    inline void appendHexBytes(wstring& out, const void* data, size_t size)
+    {
+        auto p = (const unsigned char*)data;
+        size_t at = out.size();
+        out.resize(at + 2 * size);
+        wchar_t* w = &out[at];
+        size_t i = 0;
+#ifdef _LOGGY_SSE2
+        const __m128i mask = _mm_set1_epi8(0x0f);
+        const __m128i nine = _mm_set1_epi8(9);
+        const __m128i zero = _mm_set1_epi8('0');
+        const __m128i letters = _mm_set1_epi8('a' - '0' - 10);
+        auto digits = [&](__m128i n) {
+            return _mm_add_epi8(_mm_add_epi8(n, zero), _mm_and_si128(_mm_cmpgt_epi8(n, nine), letters));
+        };
+        for (; i + 16 <= size; i += 16, w += 32) {
+            __m128i b = _mm_loadu_si128((const __m128i*)(p + i));
+            __m128i hi = digits(_mm_and_si128(_mm_srli_epi16(b, 4), mask));
+            __m128i lo = digits(_mm_and_si128(b, mask));
+            storeWide(w, _mm_unpacklo_epi8(hi, lo));
+            storeWide(w + 16, _mm_unpackhi_epi8(hi, lo));
+        }
+#endif
+        for (; i < size; ++i) {
+            *w++ = L"0123456789abcdef"[p[i] >> 4];
+            *w++ = L"0123456789abcdef"[p[i] & 15];
+        }
+    }
+
+    // Writes the statement's hexdump()s into its message, for the text formats.
+    inline void expandBlobs(Record& r)
+    {
+        if (r.blobs.empty()) {
+            return;
+        }
+        wstring msg;
+        msg.reserve(r.msg.size() + 2 * r.blob.size() + 32 * r.blobs.size());
+        const char* bytes = r.blob.data();
+        size_t from = 0;
+        for (auto& b : r.blobs) {
+            msg.append(r.msg, from, b.at - from);
+            appendHexBytes(msg, bytes, b.size);
+            if (b.total > b.size) {
+                msg += L"...(";
+                appendUInt(msg, b.total);
+                msg += L" bytes)";
+            }
+            bytes += b.size;
+            from = b.at;
+        }
+        msg.append(r.msg, from, wstring::npos);
+        r.msg.swap(msg);
+        r.blobs.clear();
+    }
+
+    // Fills frames with up to depth return addresses, starting at caller, the address the
+    // logger returns to.  No symbols are looked up: that is appendStack()'s work.
+    inline LOGGY_NOINLINE void captureStack(vector<void*>& frames, size_t depth, void* caller)
+    {
+        frames.resize(depth + 4);  // room for the logger's own frames
+#if defined(_LOGGY_BACKTRACE)
+        int n = backtrace(frames.data(), (int)frames.size());
+#elif defined(_WIN32)
+        int n = CaptureStackBackTrace(0, (DWORD)frames.size(), frames.data(), nullptr);
+#else
+        int n = 0;
+#endif
+        frames.resize((size_t)(std::max)(n, 0));
+        auto it = find(frames.begin(), frames.end(), caller);
+        if (it != frames.end()) {
+            frames.erase(frames.begin(), it);
+        }
+        if (frames.size() > depth) {
+            frames.resize(depth);
+        }
+    }
+
+    inline string demangle(const char* name)
+    {
+#ifdef _LOGGY_DEMANGLE
+        int status = 0;
+        if (char* d = abi::__cxa_demangle(name, nullptr, nullptr, &status)) {
+            string s(d);
+            free(d);
+            return s;
+        }
+#endif
+        return name;
+    }
+
+    // Appends a line per frame: the address, then the function and offset where the dynamic
+    // symbols name it, and the module and offset to hand to addr2line.
+    inline void appendStack(wstring& out, const vector<void*>& frames)
+    {
+        for (size_t i = 0; i < frames.size(); ++i) {
+            out += L"    #";
+            appendUInt(out, i);
+            out += L" 0x";
+            appendHex(out, (uint64_t)(uintptr_t)frames[i]);
+#ifdef _LOGGY_BACKTRACE
+            // a call may be the last instruction of its function, so look up the one before
+            // the return address
+            auto pc = (const char*)frames[i];
+            Dl_info info;
+            if (dladdr(pc - 1, &info)) {
+                if (info.dli_sname) {
+                    out.push_back(L' ');
+                    appendAscii(out, demangle(info.dli_sname).c_str());
+                    out += L"+0x";
+                    appendHex(out, (uint64_t)(pc - (const char*)info.dli_saddr));
+                }
+                out += L" (";
+                appendAscii(out, info.dli_fname ? baseName(info.dli_fname) : "?");
+                out += L"+0x";
+                appendHex(out, (uint64_t)(pc - (const char*)info.dli_fbase));
+                out.push_back(L')');
+            }
+#endif
+            out.push_back(L'\n');
+        }
+    }
+
+    // Per-interval aggregate of one LOG_STAT metric.  The histogram has power-of-two
+    // buckets: bucket 0 holds values below 1, bucket i values in [2^(i-1), 2^i).
+    struct StatSummary {
+        const char* name = "";
+        const char* file = "";
+        int line = 0;
+        uint64_t count = 0;
+        double sum = 0;
+        double min = 0;
+        double max = 0;
+        uint64_t buckets[STAT_BUCKETS] = {};
+
+        static int bucket(double v)
+        {
+            if (!(v >= 1)) {
+                return 0;
+            }
+            int e;
+            frexp(v, &e);
+            return e < STAT_BUCKETS ? e : STAT_BUCKETS - 1;
+        }
+
+        static double upperBound(int b) { return ldexp(1.0, b); }
+
+        void add(double v)
+        {
+            min = count ? (std::min)(min, v) : v;
+            max = count ? (std::max)(max, v) : v;
+            sum += v;
+            ++count;
+            ++buckets[bucket(v)];
+        }
+
+        // Upper bound of the bucket holding quantile q, capped by the observed maximum.
+        double quantile(double q) const
+        {
+            uint64_t rank = (uint64_t)ceil(q * count);
+            uint64_t seen = 0;
+            for (int b = 0; b < STAT_BUCKETS; ++b) {
+                seen += buckets[b];
+                if (seen >= rank && seen) {
+                    return (std::min)(upperBound(b), max);
+                }
+            }
+            return max;
+        }
+
+        wstring str() const
+        {
+            wstringstream ws;
+            ws << "stat " << name << " count=" << count << " sum=" << sum << " min=" << min
+               << " max=" << max << " mean=" << (count ? sum / count : 0) << " p50<=" << quantile(0.5)
+               << " p90<=" << quantile(0.9) << " p99<=" << quantile(0.99) << " hist=";
+            const char* sep = "";
+            for (int b = 0; b < STAT_BUCKETS; ++b) {
+                if (buckets[b]) {
+                    ws << sep << "<" << upperBound(b) << ":" << buckets[b];
+                    sep = ",";
+                }
+            }
+            return ws.str();
+        }
+    };
+
+    // What the syncs of a durable output cost, in microseconds.
+    struct DurabilityStats {
+        uint64_t syncs = 0;
+        uint64_t records = 0;    // records the syncs covered
+        StatSummary syncMicros;  // time in fdatasync
+        StatSummary waitMicros;  // time ERROR statements waited for their sync
+    };
+
+    // A producer thread's use of a fairQueueing output.
+    struct ProducerStats {
+        uint64_t tid = 0;
+        unsigned weight = 1;
+        uint64_t queued = 0;   // records waiting in the queue
+        uint64_t dropped = 0;  // records refused, in total
+    };
+
+    // An output pattern compiled into a flat list of render ops, so rendering a record is a
+    // single pass with no parsing.  Fields:
+    //   %T timestamp   %f microseconds   %t thread id   %p process id   %n logger name
+    //   %F file        %L line           %V level       %m message      %N sequence number
+    //   %% literal '%'
+    // With TS_EPOCH_NS, %T is the raw nanosecond count and the time format is unused.
+    class Layout {
+    public:
+        Layout(const string& pattern, const string& timeFormat, const string& name,
+            int timeMode = TS_LOCAL)
+            : timeFormat_(timeFormat)
+            , timeMode_(timeMode)
+        {
+            string text;
+            auto flush = [&]() {
+                if (!text.empty()) {
+                    ops_.push_back({ OP_TEXT, str2w(text) });
+                    text.clear();
+                }
+            };
+            for (size_t i = 0; i < pattern.size(); ++i) {
+                if (pattern[i] != '%' || i + 1 == pattern.size()) {
+                    text += pattern[i];
+                    continue;
+                }
+                int op = -1;
+                switch (pattern[++i]) {
+                case 'T': op = OP_TIME; break;
+                case 'f': op = OP_USEC; break;
+                case 't': op = OP_THREAD; break;
+                case 'F': op = OP_FILE; break;
+                case 'L': op = OP_LINE; break;
+                case 'V': op = OP_LEVEL; break;
+                case 'm': op = OP_MSG; break;
+                case 'N': op = OP_SEQ; break;
+                case 'p': text += to_string(processId()); break;
+                case 'n': text += name; break;
+                case '%': text += '%'; break;
+                default:
+                    text += '%';
+                    text += pattern[i];
+                    break;
+                }
+                if (op >= 0) {
+                    flush();
+                    ops_.push_back({ op, wstring() });
+                }
+            }
+            flush();
+        }
+
+        // Append the rendered record to out.
+        void render(const Record& r, wstring& out)
+        {
+            for (auto& op : ops_) {
+                switch (op.op) {
+                case OP_TEXT: out += op.text; break;
+                case OP_TIME:
+                    if (timeMode_ == TS_EPOCH_NS) {
+                        appendUInt(out, (uint64_t)r.ns);
+                        break;
+                    }
+                    if (r.seconds() != cachedSecond_) {
+                        cachedSecond_ = r.seconds();
+                        cachedTime_.clear();
+                        if (timeMode_ == TS_UTC) {
+                            char buf[120];
+                            utcTimestamp(buf, sizeof(buf), timeFormat_.c_str(), cachedSecond_);
+                            appendAscii(cachedTime_, buf);
+                        }
+                        else {
+                            appendAscii(cachedTime_, timestamp(timeFormat_.c_str(), cachedSecond_).c_str());
+                        }
+                    }
+                    out += cachedTime_;
+                    break;
+                case OP_USEC: appendUInt(out, (uint64_t)(r.ns % 1000000000) / 1000, 6); break;
+                case OP_THREAD: appendUInt(out, r.tid); break;
+                case OP_FILE: appendAscii(out, baseName(r.file)); break;
+                case OP_LINE: appendUInt(out, (uint64_t)r.line); break;
+                case OP_LEVEL: appendAscii(out, levelName(r.level)); break;
+                case OP_MSG: out += r.msg; break;
+                case OP_SEQ: appendUInt(out, r.seq); break;
+                }
+            }
+        }
+
+    private:
+        enum { OP_TEXT, OP_TIME, OP_USEC, OP_THREAD, OP_FILE, OP_LINE, OP_LEVEL, OP_MSG, OP_SEQ };
+
+        struct Op {
+            int op;
+            wstring text;
+        };
+
+        vector<Op> ops_;
+        string timeFormat_;
+        int timeMode_;
+        time_t cachedSecond_ = -1;
+        wstring cachedTime_;
+    };
+
+    // Bounded lock-free MPMC ring (D. Vyukov's sequence-numbered slots) carrying records
+    // logged from signal handlers.  push() only touches preallocated slots and lock-free
+    // atomics, so it is async-signal-safe; when the ring is full the record is counted and
+    // dropped rather than waited for.
+    class SignalRing {
+    public:
+        SignalRing()
+        {
+            for (size_t i = 0; i < SIGNAL_SLOTS; ++i) {
+                slots_[i].seq.store(i, memory_order_relaxed);
+            }
+        }
+
+        bool push(int level, const char* file, int line, const char* msg, const long long* value)
+        {
+            size_t pos = tail_.load(memory_order_relaxed);
+            Slot* s;
+            for (;;) {
+                s = &slots_[pos % SIGNAL_SLOTS];
+                auto dif = (intptr_t)s->seq.load(memory_order_acquire) - (intptr_t)pos;
+                if (dif == 0) {
+                    if (tail_.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                        break;
+                }
+                else if (dif < 0) {
+                    dropped_.fetch_add(1, memory_order_relaxed);
+                    return false;
+                }
+                else {
+                    pos = tail_.load(memory_order_relaxed);
+                }
+            }
+
+            s->level = level;
+            s->ns = nowNs();
+            s->file = file;
+            s->line = line;
+            s->tid = signalThreadId();
+            size_t n = 0;
+            while (msg && *msg && n < SIGNAL_MSG_SIZE)
+                s->text[n++] = *msg++;
+            if (value) {
+                char digits[24];
+                int d = 0;
+                unsigned long long v = *value < 0 ? 0ull - (unsigned long long)*value : *value;
+                do {
+                    digits[d++] = (char)('0' + v % 10);
+                    v /= 10;
+                } while (v);
+                if (*value < 0)
+                    digits[d++] = '-';
+                if (n < SIGNAL_MSG_SIZE)
+                    s->text[n++] = ' ';
+                while (d && n < SIGNAL_MSG_SIZE)
+                    s->text[n++] = digits[--d];
+            }
+            s->len = n;
+            s->seq.store(pos + 1, memory_order_release);
+            return true;
+        }
+
+        bool pop(Record& r)
+        {
+            size_t pos = head_.load(memory_order_relaxed);
+            Slot* s;
+            for (;;) {
+                s = &slots_[pos % SIGNAL_SLOTS];
+                auto dif = (intptr_t)s->seq.load(memory_order_acquire) - (intptr_t)(pos + 1);
+                if (dif == 0) {
+                    if (head_.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                        break;
+                }
+                else if (dif < 0) {
+                    return false;
+                }
+                else {
+                    pos = head_.load(memory_order_relaxed);
+                }
+            }
+
+            r = Record();
+            r.level = s->level;
+            r.ns = s->ns;
+            r.file = s->file;
+            r.line = s->line;
+            r.tid = s->tid;
+            for (size_t i = 0; i < s->len; ++i)
+                r.msg.push_back((wchar_t)(unsigned char)s->text[i]);
+            s->seq.store(pos + SIGNAL_SLOTS, memory_order_release);
+            return true;
+        }
+
+        bool empty() const
+        {
+            return head_.load(memory_order_acquire) == tail_.load(memory_order_acquire);
+        }
+
+        bool idle() const { return empty() && !dropped_.load(memory_order_relaxed); }
+
+        size_t takeDropped() { return dropped_.exchange(0, memory_order_relaxed); }
+
+    private:
+        // threadId() caches in a thread_local, which is not guaranteed safe in a handler
+        static uint64_t signalThreadId()
+        {
+#if defined(_WIN32)
+            return GetCurrentThreadId();
+#elif defined(__linux__)
+            return (uint64_t)syscall(SYS_gettid);
+#else
+            return 0;
+#endif
+        }
+
+        struct Slot {
+            atomic<size_t> seq;
+            int level;
+            int64_t ns;
+            const char* file;
+            int line;
+            uint64_t tid;
+            size_t len;
+            char text[SIGNAL_MSG_SIZE];
+        };
+
+        Slot slots_[SIGNAL_SLOTS];
+        atomic<size_t> head_ { 0 };
+        atomic<size_t> tail_ { 0 };
+        atomic<size_t> dropped_ { 0 };
+    };
+
+    // Encodes wide text as UTF-8.  Unlike w2str it never throws: output threads can't report
+    // an error, so invalid code units become U+FFFD.
+    inline void appendUtf8(string& out, const wchar_t* s, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i) {
+            uint32_t c = (uint32_t)s[i];
+            if (sizeof(wchar_t) == 2 && c >= 0xD800 && c < 0xDC00 && i + 1 < n
+                && (uint32_t)s[i + 1] >= 0xDC00 && (uint32_t)s[i + 1] < 0xE000) {
+                c = 0x10000 + ((c - 0xD800) << 10) + ((uint32_t)s[++i] - 0xDC00);
+            }
+            if (c > 0x10FFFF || (c >= 0xD800 && c < 0xE000)) {
+                c = 0xFFFD;
+            }
+            if (c < 0x80) {
+                out.push_back((char)c);
+            }
+            else if (c < 0x800) {
+                out.push_back((char)(0xC0 | (c >> 6)));
+                out.push_back((char)(0x80 | (c & 0x3F)));
+            }
+            else if (c < 0x10000) {
+                out.push_back((char)(0xE0 | (c >> 12)));
+                out.push_back((char)(0x80 | ((c >> 6) & 0x3F)));
+                out.push_back((char)(0x80 | (c & 0x3F)));
+            }
+            else {
+                out.push_back((char)(0xF0 | (c >> 18)));
+                out.push_back((char)(0x80 | ((c >> 12) & 0x3F)));
+                out.push_back((char)(0x80 | ((c >> 6) & 0x3F)));
+                out.push_back((char)(0x80 | (c & 0x3F)));
+            }
+        }
+    }
+
+    // Queue policies.  MutexQueue is the condition-variable SafeQueue, RingQueue a bounded
+    // lock-free ring producers never block on (a full ring drops the record).  Both are
+    // consumed by the output's worker thread only.
+    class MutexQueue : public SafeQueue<Record> {
+    public:
+        explicit MutexQueue(size_t) {}
+
+        bool push(const Record& r)
+        {
+            SafeQueue<Record>::push(r);
+            return true;
+        }
+    };
+
+    class RingQueue {
+    public:
+        explicit RingQueue(size_t capacity)
+        {
+            size_t n = 2;
+            while (n < (capacity ? capacity : RING_SLOTS)) {
+                n <<= 1;
+            }
+            mask_ = n - 1;
+            slots_.reset(new Slot[n]);
+            for (size_t i = 0; i < n; ++i) {
+                slots_[i].seq.store(i, memory_order_relaxed);
+            }
+        }
+
+        bool push(const Record& r)
+        {
+            if (quit_.load(memory_order_relaxed)) {
+                return false;
+            }
+            size_t pos = tail_.load(memory_order_relaxed);
+            Slot* s;
+            for (;;) {
+                s = &slots_[pos & mask_];
+                auto dif = (intptr_t)s->seq.load(memory_order_acquire) - (intptr_t)pos;
+                if (dif == 0) {
+                    if (tail_.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                        break;
+                }
+                else if (dif < 0) {
+                    return false;
+                }
+                else {
+                    pos = tail_.load(memory_order_relaxed);
+                }
+            }
+            s->rec = r;  // reuses the slot's string capacity
+            s->seq.store(pos + 1, memory_order_release);
+
+            // pairs with the fence in wait(): either the consumer sees the record or we see it
+            // asleep and wake it under its mutex
+            atomic_thread_fence(memory_order_seq_cst);
+            if (sleeping_.load(memory_order_relaxed)) {
+                lock_guard<mutex> lock(m_);
+                c_.notify_all();
+            }
+            return true;
+        }
+
+        bool pop(Record& r) { return popUntil(r, (const chrono::steady_clock::time_point*)nullptr); }
+
+        template <class TimePoint> bool pop(Record& r, const TimePoint& deadline)
+        {
+            return popUntil(r, &deadline);
+        }
+
+        bool tryPop(Record& r)
+        {
+            size_t pos = head_.load(memory_order_relaxed);
+            Slot* s = &slots_[pos & mask_];
+            if (s->seq.load(memory_order_acquire) != pos + 1) {
+                return false;
+            }
+            swap(r, s->rec);
+            s->seq.store(pos + mask_ + 1, memory_order_release);
+            head_.store(pos + 1, memory_order_release);
+            return true;
+        }
+
+        size_t size() const
+        {
+            return tail_.load(memory_order_relaxed) - head_.load(memory_order_relaxed);
+        }
+
+        void done()
+        {
+            if (done_.fetch_add(1, memory_order_release) + 1 == tail_.load(memory_order_acquire)) {
+                lock_guard<mutex> lock(m_);
+                c_.notify_all();
+            }
+        }
+
+        // Waits till every record pushed so far has been popped and done.
+        void join()
+        {
+            unique_lock<mutex> lock(m_);
+            size_t target = tail_.load(memory_order_acquire);
+            while (!quit_ && done_.load(memory_order_acquire) < target) {
+                c_.wait_for(lock, chrono::milliseconds(10));
+            }
+        }
+
+        size_t quit()
+        {
+            quit_ = true;
+            lock_guard<mutex> lock(m_);
+            c_.notify_all();
+            return size();
+        }
+
+    private:
+        struct Slot {
+            atomic<size_t> seq;
+            Record rec;
+        };
+
+        template <class TimePoint> bool popUntil(Record& r, const TimePoint* deadline)
+        {
+            for (int spin = 0;; ++spin) {
+                if (quit_.load(memory_order_relaxed)) {
+                    return false;
+                }
+                if (tryPop(r)) {
+                    return true;
+                }
+                if (spin < RING_SPINS) {
+                    this_thread::yield();
+                }
+                else if (!wait(deadline)) {
+                    return !quit_ && tryPop(r);
+                }
+            }
+        }
+
+        // Sleeps until a record may be available; false once the deadline passed.
+        template <class TimePoint> bool wait(const TimePoint* deadline)
+        {
+            unique_lock<mutex> lock(m_);
+            sleeping_.store(true, memory_order_relaxed);
+            atomic_thread_fence(memory_order_seq_cst);
+            bool timeout = false;
+            if (!quit_ && !size()) {
+                if (deadline)
+                    timeout = c_.wait_until(lock, *deadline) == cv_status::timeout;
+                else
+                    c_.wait(lock);
+            }
+            sleeping_.store(false, memory_order_relaxed);
+            return !timeout;
+        }
+
+        unique_ptr<Slot[]> slots_;
+        size_t mask_;
+        atomic<size_t> head_ { 0 };
+        atomic<size_t> tail_ { 0 };
+        atomic<size_t> done_ { 0 };
+        atomic<bool> quit_ { false };
+        atomic<bool> sleeping_ { false };
+        mutex m_;
+        condition_variable c_;
+    };
+
+    // Formatter policies turn records into the bytes or characters a sink writes; shows()
+    // tells which records they write at all.  begin() and end() frame the whole stream; framed
+    // formats produce one document per file, so their files are truncated, not appended.
+    // parallel formats keep no state between records, so copies may format a batch together.
+
+    class TextFormat {
+    public:
+        using buffer_type = wstring;
+        static constexpr bool framed = false;
+        static constexpr bool parallel = true;
+
+        explicit TextFormat(const OutputConfig& config)
+            : layout_(config.pattern, config.timeFormat, config.name, config.timeMode)
+        {
+        }
+
+        void begin(buffer_type&) {}
+        void end(buffer_type&) {}
+
+        bool shows(const Record& r) const { return r.kind != REC_SPAN && r.kind != REC_STAT; }
+
+        bool format(Record& r, buffer_type& out)
+        {
+            if (!shows(r)) {
+                return false;
+            }
+            if (r.kind == REC_RAW) {
+                out += r.msg;
+            }
+            else {
+                expandBlobs(r);
+                layout_.render(r, out);
+            }
+            out.push_back(L'\n');
+            appendStack(out, r.frames);
+            return true;
+        }
+
+    private:
+        Layout layout_;
+    };
+
+    // Chrome trace_event JSON.  Spans become complete ("X") events, log statements at or
+    // above the output level become thread-scoped instant ("i") events.
+    class TraceFormat {
+    public:
+        using buffer_type = wstring;
+        static constexpr bool framed = true;
+        static constexpr bool parallel = false;  // the first event has no leading comma
+
+        explicit TraceFormat(const OutputConfig& config)
+            : level_(config.level)
+        {
+        }
+
+        void begin(buffer_type& out)
+        {
+            events_ = 0;
+            out += L"[\n";
+        }
+        void end(buffer_type& out) { out += L"]\n"; }
+
+        bool shows(const Record& r) const
+        {
+            return r.kind == REC_SPAN || r.kind == REC_GAP || (r.kind == REC_TEXT && r.level >= level_);
+        }
+
+        bool format(Record& r, buffer_type& line)
+        {
+            if (!shows(r)) {
+                return false;
+            }
+            line += events_++ ? L",{\"name\":\"" : L"{\"name\":\"";
+            if (r.kind == REC_SPAN) {
+                appendJson(line, r.name);
+                line += L"\",\"cat\":\"span\",\"ph\":\"X\",\"ts\":";
+                appendMicros(line, r.ns);
+                line += L",\"dur\":";
+                appendMicros(line, r.dur);
+            }
+            else {
+                expandBlobs(r);
+                appendJson(line, r.msg.c_str());
+                line += L"\",\"cat\":\"";
+                appendAscii(line, levelName(r.level));
+                line += L"\",\"ph\":\"i\",\"s\":\"t\",\"ts\":";
+                appendMicros(line, r.ns);
+            }
+            line += L",\"pid\":";
+            appendUInt(line, processId());
+            line += L",\"tid\":";
+            appendUInt(line, r.tid);
+            line += L",\"args\":{\"file\":\"";
+            appendJson(line, baseName(r.file));
+            line += L"\",\"line\":";
+            appendUInt(line, (uint64_t)r.line);
+            line += L"}}\n";
+            return true;
+        }
+
+    private:
+        int level_;
+        size_t events_ = 0;
+    };
+
+    // Length-prefixed binary records in host byte order:
+    //   u32 size of the rest, u8 kind, u64 seq, i32 level, i64 ns, u64 tid, i32 line,
+    //   str file, str name, i64 dur, f64 value, str msg (UTF-8), where str is u32 length +
+    //   bytes.  A REC_GAP record's seq is the first one lost and value the number lost.
+    //   A stack trace follows the message text in msg, a line per frame.  If the statement
+    //   had hexdump()s, msg is followed by u32 count and, per dump, u32 offset into msg
+    //   and str bytes.
+    class BinaryFormat {
+    public:
+        using buffer_type = string;
+        static constexpr bool framed = false;
+        static constexpr bool parallel = true;
+
+        explicit BinaryFormat(const OutputConfig&) {}
+
+        void begin(buffer_type&) {}
+        void end(buffer_type&) {}
+
+        bool shows(const Record& r) const { return r.kind != REC_STAT; }
+
+        bool format(Record& r, buffer_type& out)
+        {
+            size_t start = out.size();
+            put(out, (uint32_t)0);
+            put(out, (uint8_t)r.kind);
+            put(out, (uint64_t)r.seq);
+            put(out, (int32_t)r.level);
+            put(out, (int64_t)r.ns);
+            put(out, (uint64_t)r.tid);
+            put(out, (int32_t)r.line);
+            putString(out, r.file, strlen(r.file));
+            putString(out, r.name, strlen(r.name));
+            put(out, (int64_t)r.dur);
+            put(out, r.value);
+            size_t at = out.size();
+            put(out, (uint32_t)0);
+            vector<uint32_t> offsets;
+            size_t from = 0;
+            for (auto& b : r.blobs) {
+                appendUtf8(out, r.msg.data() + from, b.at - from);
+                offsets.push_back((uint32_t)(out.size() - at - sizeof(uint32_t)));
+                from = b.at;
+            }
+            appendUtf8(out, r.msg.data() + from, r.msg.size() - from);
+            if (!r.frames.empty()) {
+                wstring stack(L"\n");
+                appendStack(stack, r.frames);
+                stack.pop_back();
+                appendUtf8(out, stack.data(), stack.size());
+            }
+            uint32_t len = (uint32_t)(out.size() - at - sizeof(uint32_t));
+            memcpy(&out[at], &len, sizeof(len));
+            if (!r.blobs.empty()) {
+                put(out, (uint32_t)r.blobs.size());
+                const char* bytes = r.blob.data();
+                for (size_t i = 0; i < r.blobs.size(); ++i) {
+                    put(out, offsets[i]);
+                    putString(out, bytes, r.blobs[i].size);
+                    bytes += r.blobs[i].size;
+                }
+            }
+            uint32_t size = (uint32_t)(out.size() - start - sizeof(uint32_t));
+            memcpy(&out[start], &size, sizeof(size));
+            return true;
+        }
+
+    private:
+        template <class T> static void put(buffer_type& out, T v)
+        {
+            out.append((const char*)&v, sizeof(v));
+        }
+
+        static void putString(buffer_type& out, const char* s, size_t n)
+        {
+            put(out, (uint32_t)n);
+            out.append(s, n);
+        }
+    };
+
+    // Sink policies write what a formatter produced: wide text as is to wide streams and as
+    // UTF-8 to byte sinks.
+
+    class StreamSink {
+    public:
+        StreamSink(wostream& s, const OutputConfig&, bool)
+            : stream_(s)
+        {
+        }
+
+        void write(const wstring& s) { stream_.write(s.data(), (streamsize)s.size()); }
+
+        void write(const string& s)
+        {
+            for (char c : s) {
+                stream_.put((wchar_t)(unsigned char)c);
+            }
+        }
+
+        void flush() { stream_.flush(); }
+        void sync() { flush(); }
+        void reopen(bool) { flush(); }
+        string name() const { return "stream"; }
+
+    private:
+        wostream& stream_;
+    };
+
+    // Appends through an O_APPEND descriptor.  Records are collected and written with one
+    // write() per WRITE_BATCH_BYTES or flush(), and a record never straddles two writes, so
+    // processes appending to the same file interleave only between records (on local POSIX
+    // filesystems, where O_APPEND writes are atomic).
+    class FileSink {
+    public:
+        // The file is opened by the first write that reaches it, so an output that never
+        // writes leaves no file behind.
+        FileSink(const wstring& path, const OutputConfig&, bool truncate)
+            : path_(path)
+            , truncate_(truncate)
+        {
+        }
+
+        FileSink(const FileSink&) = delete;
+        FileSink& operator=(const FileSink&) = delete;
+
+        ~FileSink()
+        {
+            flush();
+            if (fd_ >= 0) {
+#ifdef _WIN32
+                _close(fd_);
+#else
+                ::close(fd_);
+#endif
+            }
+        }
+
+        void write(const wstring& s)
+        {
+            utf8_.clear();
+            appendUtf8(utf8_, s.data(), s.size());
+            write(utf8_);
+        }
+
+        void write(const string& s)
+        {
+            if (!pending_.empty() && pending_.size() + s.size() > WRITE_BATCH_BYTES) {
+                flush();
+            }
+            pending_ += s;
+        }
+
+        void flush()
+        {
+            const char* p = pending_.data();
+            size_t n = pending_.size();
+            if (n && !opened_) {
+                open();
+            }
+            while (n && fd_ >= 0) {
+#ifdef _WIN32
+                auto w = _write(fd_, p, (unsigned)n);
+#else
+                auto w = ::write(fd_, p, n);
+#endif
+                if (w < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    break;  // nowhere to report it; the batch is lost
+                }
+                p += w;
+                n -= (size_t)w;
+            }
+            pending_.clear();
+        }
+
+        // Flushes and returns once the data is on disk.
+        void sync()
+        {
+            flush();
+            if (fd_ >= 0) {
+#if defined(_WIN32)
+                _commit(fd_);
+#elif defined(__APPLE__)
+                fsync(fd_);
+#else
+                fdatasync(fd_);
+#endif
+            }
+        }
+
+        // Closes the file, so the next write opens whatever is at the path then, e.g. after
+        // logrotate moved it.  With rename, first moves it aside to PATH.YYYYmmdd-HHMMSS.
+        void reopen(bool rename)
+        {
+            flush();
+            if (fd_ >= 0) {
+#ifdef _WIN32
+                _close(fd_);
+#else
+                ::close(fd_);
+#endif
+                fd_ = -1;
+            }
+            if (rename && opened_) {
+                auto t = time(nullptr);
+                tm tm;
+#ifdef _WIN32
+                gmtime_s(&tm, &t);
+#else
+                gmtime_r(&t, &tm);
+#endif
+                char suffix[32];
+                strftime(suffix, sizeof(suffix), ".%Y%m%d-%H%M%S", &tm);
+#ifdef _WIN32
+                _wrename(path_.c_str(), (path_ + str2w(suffix)).c_str());
+#else
+                ::rename(w2str(path_).c_str(), (w2str(path_) + suffix).c_str());
+#endif
+            }
+            opened_ = false;
+        }
+
+        string name() const { return w2str(path_); }
+
+    private:
+        void open()
+        {
+            opened_ = true;
+            int flags = O_WRONLY | O_CREAT | O_APPEND | (truncate_ ? O_TRUNC : 0);
+#ifdef _WIN32
+            fd_ = _wopen(path_.c_str(), flags | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+            fd_ = ::open(w2str(path_).c_str(), flags | O_CLOEXEC, 0644);
+#endif
+        }
+
+        wstring path_;
+        bool truncate_;
+        bool opened_ = false;
+        int fd_ = -1;
+        string pending_;
+        string utf8_;
+    };
+
+    // Collects output in memory, mainly for tests and in-process inspection.
+    class MemoryBuffer {
+    public:
+        void append(const string& s)
+        {
+            lock_guard<mutex> lock(m_);
+            data_ += s;
+        }
+
+        string str()
+        {
+            lock_guard<mutex> lock(m_);
+            return data_;
+        }
+
+        void clear()
+        {
+            lock_guard<mutex> lock(m_);
+            data_.clear();
+        }
+
+    private:
+        mutex m_;
+        string data_;
+    };
+
+    class MemorySink {
+    public:
+        MemorySink(shared_ptr<MemoryBuffer> buffer, const OutputConfig&, bool)
+            : buffer_(std::move(buffer))
+        {
+        }
+
+        void write(const wstring& s)
+        {
+            utf8_.clear();
+            appendUtf8(utf8_, s.data(), s.size());
+            buffer_->append(utf8_);
+        }
+
+        void write(const string& s) { buffer_->append(s); }
+        void flush() {}
+        void sync() {}
+        void reopen(bool) {}
+        string name() const { return "memory"; }
+
+    private:
+        shared_ptr<MemoryBuffer> buffer_;
+        string utf8_;
+    };
+
+    // Threads that help an output's worker format a batch.  run() hands the job to every
+    // shard, with the calling thread taking shard 0, and returns once all have finished.
+    class FormatPool {
+    public:
+        explicit FormatPool(size_t shards)
+        {
+            for (size_t i = 1; i < shards; ++i) {
+                threads_.emplace_back(&FormatPool::loop, this, i);
+            }
+        }
+
+        ~FormatPool()
+        {
+            {
+                lock_guard<mutex> lock(m_);
+                quit_ = true;
+            }
+            c_.notify_all();
+            for (auto& t : threads_) {
+                t.join();
+            }
+        }
+
+        size_t shards() const { return threads_.size() + 1; }
+
+        void run(const function<void(size_t)>& job)
+        {
+            {
+                lock_guard<mutex> lock(m_);
+                job_ = &job;
+                pending_ = threads_.size();
+                ++generation_;
+            }
+            c_.notify_all();
+            job(0);
+            unique_lock<mutex> lock(m_);
+            while (pending_) {
+                finished_.wait(lock);
+            }
+            job_ = nullptr;
+        }
+
+    private:
+        void loop(size_t shard)
+        {
+            size_t seen = 0;
+            for (;;) {
+                const function<void(size_t)>* job;
+                {
+                    unique_lock<mutex> lock(m_);
+                    while (!quit_ && generation_ == seen) {
+                        c_.wait(lock);
+                    }
+                    if (quit_) {
+                        return;
+                    }
+                    seen = generation_;
+                    job = job_;
+                }
+                (*job)(shard);
+                lock_guard<mutex> lock(m_);
+                if (--pending_ == 0) {
+                    finished_.notify_one();
+                }
+            }
+        }
+
+        vector<std::thread> threads_;
+        mutex m_;
+        condition_variable c_;
+        condition_variable finished_;
+        const function<void(size_t)>* job_ = nullptr;
+        size_t generation_ = 0;
+        size_t pending_ = 0;
+        bool quit_ = false;
+    };
+
+    // Empties a shared stats slot for the next output to use it: the counters are running
+    // totals, which would otherwise carry over.
+    inline void clearSlot(SharedOutputStats& slot)
+    {
+        memset(slot.name, 0, sizeof(slot.name));
+        for (auto c : { &slot.capacity, &slot.depth, &slot.queued, &slot.written, &slot.dropped,
+                 &slot.latencyP50Ns, &slot.latencyP99Ns, &slot.latencyMaxNs }) {
+            c->store(0, memory_order_relaxed);
+        }
+        for (auto& l : slot.levels) {
+            l.store(0, memory_order_relaxed);
+        }
+        slot.updatedNs.store(0, memory_order_relaxed);
+    }
+
+    // What Log sees of an output.
+    class Output {
+    public:
+        virtual ~Output() {}
+
+        // Called by producers concurrently, without the logger's mutex.  force bypasses the
+        // bound, for the logger's own notices.  The first call starts the output.
+        virtual void add(const Record& r, bool force = false) = 0;
+
+        // Starts the worker thread ahead of the first record, e.g. to poll for signal records.
+        virtual void start() = 0;
+
+        // Queues what add() is holding back, so a following wait() covers it.  Called under
+        // the logger's mutex.
+        virtual void sync() = 0;
+
+        // Blocks until the queue is empty.
+        virtual void wait() = 0;
+
+        // Queue fill ratio, 0 for unbounded outputs.
+        virtual double pressure() = 0;
+
+        // For DURABLE_ERROR outputs: a ticket covering everything queued so far, to pass to
+        // waitDurable() once the producer has left its read section.  0 means nothing to wait
+        // for.  Called right after add(), in the same read section.
+        virtual uint64_t ticket() = 0;
+        virtual void waitDurable(uint64_t ticket) = 0;
+
+        // False for DURABLE_NONE outputs.
+        virtual bool durabilityStats(DurabilityStats& stats) = 0;
+
+        // False unless the output was configured with fairQueueing.
+        virtual bool producerStats(vector<ProducerStats>& stats) = 0;
+
+        // Has the worker keep slot, in the shared stats segment, up to date; null stops it.
+        // Called under the logger's mutex.
+        virtual void publishStats(SharedOutputStats* slot) = 0;
+
+        // Has the worker close and reopen the sink once it has written what is queued now,
+        // moving the file aside first with rename.  False for a framed output without
+        // rename: its file holds one document, which reopening would cut or append to.
+        // Called under the logger's mutex.
+        virtual bool reopen(bool rename) = 0;
+
+        // The file written, or "stream" / "memory".
+        virtual string name() = 0;
+
+        // True if the output writes LOG_SCOPE spans, so they are worth recording.
+        virtual bool traces() = 0;
+    };
+
+    // An output assembled from compile-time policies: the queue between producers and the
+    // worker thread, the record format, and where the formatted records go.
+    template <class QueuePolicy, class FormatterPolicy, class SinkPolicy>
+    class BasicOutput : public Output {
+        using buffer_type = typename FormatterPolicy::buffer_type;
+
+        QueuePolicy queue_;  // this should be first
+        SinkPolicy sink_;
+        FormatterPolicy formatter_;
+        size_t max_;
+        double statSeconds_;
+        bool sampled_ = false;  // writes the LOG_STAT summary lines, so wants the samples
+        // keyed by the name's text: a library and the program may hold the same literal twice
+        unordered_map<string_view, StatSummary> stats_;
+        chrono::steady_clock::time_point statsDue_;
+        atomic<bool> alive_ { true };
+        atomic<uint64_t> lost_ { 0 };  // shown records dropped since the last gap record
+        atomic<int64_t> lostNs_ { 0 };
+        uint64_t seq_ = 0;   // worker only
+
+        int durability_;
+        double syncSeconds_;
+        atomic<uint64_t> queued_ { 0 };     // records queued
+        atomic<uint64_t> processed_ { 0 };  // records the worker is done with
+        atomic<uint64_t> wanted_ { 0 };     // highest ticket handed out
+        chrono::steady_clock::time_point syncDue_;
+        mutex syncMutex_;
+        condition_variable syncCv_;
+        uint64_t synced_ = 0;  // records on disk; written by the worker under syncMutex_
+        size_t waiters_ = 0;
+        DurabilityStats durabilityStats_;
+
+        // fairQueueing: the producers with records queued or dropped, by thread id
+        struct Producer {
+            unsigned weight = 1;
+            uint64_t queued = 0;
+            uint64_t dropped = 0;
+            uint64_t lost = 0;  // since the last gap record
+        };
+        bool fair_;
+        mutex fairMutex_;
+        unordered_map<uint64_t, Producer> producers_;
+        uint64_t queuedWeight_ = 0;  // total weight of the producers with records queued
+
+        // enableSharedStats(): the slot and what the worker has counted for it
+        atomic<SharedOutputStats*> slot_ { nullptr };
+        uint64_t gapped_ = 0;  // dropped records the worker has seen gaps for
+        StatSummary latency_;  // ns from statement to write, this period
+        int64_t publishDue_ = 0;
+
+        enum { REOPEN_NONE = 0, REOPEN, REOPEN_RENAME };
+        atomic<int> reopen_ { REOPEN_NONE };
+        atomic<uint64_t> reopenAt_ { 0 };  // records to process before the reopen
+
+        double flushSeconds_;
+        bool dirty_ = false;  // written but not flushed, worker only
+        chrono::steady_clock::time_point flushDue_;
+        atomic<bool> flushAsked_ { false };
+
+        // with formatThreads > 1: the batch, its formatted records, and a formatter per
+        // extra shard
+        unique_ptr<FormatPool> pool_;
+        vector<Record> batch_;
+        vector<buffer_type> formatted_;
+        vector<char> shown_;
+        vector<FormatterPolicy> formatters_;
+
+        size_t formatThreads_;
+        once_flag startOnce_;
+        atomic<bool> started_ { false };
+        std::thread thread_;  // started by start()
+
+    public:
+        template <class Target>
+        BasicOutput(Target&& target, const OutputConfig& config)
+            : queue_(config.bufferSize)
+            , sink_(std::forward<Target>(target), config, FormatterPolicy::framed)
+            , formatter_(config)
+            , max_(config.bufferSize)
+            , statSeconds_(config.statSeconds)
+            , durability_(config.durability)
+            , syncSeconds_(config.syncSeconds)
+            , fair_(config.fairQueueing && config.bufferSize > 0)
+            , flushSeconds_(config.flushSeconds)
+            , formatThreads_(config.formatThreads)
+        {
+            durabilityStats_.syncMicros.name = "sync_us";
+            durabilityStats_.waitMicros.name = "sync_wait_us";
+            Record summary;
+            summary.level = LINFO;
+            sampled_ = statSeconds_ > 0 && formatter_.shows(summary);
+        }
+
+        ~BasicOutput()
+        {
+            alive_ = false;
+            {
+                unique_lock<mutex> lock(syncMutex_);
+                syncCv_.notify_all();
+                while (waiters_) {
+                    syncCv_.wait(lock);
+                }
+            }
+            queue_.quit();
+            if (thread_.joinable()) {
+                thread_.join();
+            }
+        }
+
+        void start() override
+        {
+            if (started_.load(memory_order_acquire)) {
+                return;
+            }
+            call_once(startOnce_, [this] {
+                if (FormatterPolicy::parallel && formatThreads_ > 1) {
+                    pool_.reset(new FormatPool(formatThreads_));
+                }
+                thread_ = std::thread(&BasicOutput::worker, this);
+                started_.store(true, memory_order_release);
+            });
+        }
+
+        void sync() override
+        {
+            if (!started_.load(memory_order_acquire)) {
+                return;  // nothing was ever queued
+            }
+            if (alive_ && lost_) {
+                pushGap();
+            }
+            if (alive_) {
+                pushFlush();
+            }
+        }
+
+        void wait() override { queue_.join(); }
+
+        double pressure() override { return max_ ? (double)queue_.size() / max_ : 0; }
+
+        uint64_t ticket() override
+        {
+            if (durability_ != DURABLE_ERROR || !queued_) {
+                return 0;
+            }
+            uint64_t ticket = queued_;
+            {
+                lock_guard<mutex> lock(syncMutex_);
+                ++waiters_;
+            }
+            // only ever raised: a late smaller store would hide a larger ticket from finish()
+            auto wanted = wanted_.load();
+            while (wanted < ticket && !wanted_.compare_exchange_weak(wanted, ticket)) {
+            }
+            if (processed_.load() >= (std::max)(wanted, ticket)) {
+                // the worker went past without seeing the highest ticket and may be asleep
+                pushFlush();
+            }
+            return ticket;
+        }
+
+        void waitDurable(uint64_t ticket) override
+        {
+            auto start = chrono::steady_clock::now();
+            unique_lock<mutex> lock(syncMutex_);
+            while (alive_ && synced_ < ticket) {
+                syncCv_.wait(lock);
+            }
+            durabilityStats_.waitMicros.add(
+                (double)chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start)
+                    .count());
+            if (--waiters_ == 0) {
+                syncCv_.notify_all();
+            }
+        }
+
+        bool durabilityStats(DurabilityStats& stats) override
+        {
+            if (durability_ == DURABLE_NONE) {
+                return false;
+            }
+            lock_guard<mutex> lock(syncMutex_);
+            stats = durabilityStats_;
+            return true;
+        }
+
+        bool reopen(bool rename) override
+        {
+            if (FormatterPolicy::framed && !rename) {
+                return false;
+            }
+            if (!started_.load(memory_order_acquire)) {
+                return true;  // no file open yet
+            }
+            pushFlush();
+            reopenAt_ = queued_.load();
+            reopen_ = rename ? REOPEN_RENAME : (std::max)(reopen_.load(), (int)REOPEN);
+            return true;
+        }
+
+        string name() override { return sink_.name(); }
+
+        bool traces() override
+        {
+            Record span;
+            span.kind = REC_SPAN;
+            return formatter_.shows(span);
+        }
+
+        void publishStats(SharedOutputStats* slot) override
+        {
+            if (slot) {
+                auto name = sink_.name();
+                clearSlot(*slot);
+                memcpy(slot->name, name.data(), (std::min)(name.size(), sizeof(slot->name) - 1));
+                slot->capacity = max_;
+            }
+            slot_.store(slot, memory_order_release);
+        }
+
+        bool producerStats(vector<ProducerStats>& stats) override
+        {
+            if (!fair_) {
+                return false;
+            }
+            lock_guard<mutex> lock(fairMutex_);
+            stats.clear();
+            for (auto& it : producers_) {
+                stats.push_back({ it.first, it.second.weight, it.second.queued, it.second.dropped });
+            }
+            return true;
+        }
+
+        // Drops are reported by a gap record queued ahead of the next record that fits.
+        // Concurrent producers may overshoot the bound by a record each.
+        void add(const Record& r, bool force = false) override
+        {
+            if (!alive_ || !wants(r)) {
+                return;
+            }
+            start();
+            if ((force || max_ == 0 || queue_.size() < max_) && (!fair_ || admit(r, force))) {
+                if ((!lost_.load(memory_order_relaxed) || pushGap()) && queue_.push(r)) {
+                    ++queued_;
+                    return;
+                }
+                if (fair_) {
+                    release(r);
+                }
+            }
+            if (formatter_.shows(r)) {
+                if (!lost_++) {
+                    lostNs_.store(r.ns, memory_order_relaxed);
+                }
+                if (fair_) {
+                    blame(r.tid);
+                }
+            }
+        }
+
+    private:
+        // Records this output would discard never take a queue slot or wake the worker.
+        bool wants(const Record& r) const
+        {
+            return r.kind == REC_STAT ? sampled_ : formatter_.shows(r);
+        }
+
+        // Fair queueing: past FAIR_QUEUE_START of the bound, a thread may only add while it
+        // has fewer records queued than its weighted share of the bound.  Shares are taken
+        // among the threads with records queued, plus one default weight held back for a
+        // thread that has none, so a newcomer always finds room and a runaway thread's
+        // overflow is dropped and blamed on it alone.  Charges the thread for the record.
+        bool admit(const Record& r, bool force)
+        {
+            lock_guard<mutex> lock(fairMutex_);
+            auto& p = producers_[r.tid];
+            if (!p.queued) {
+                p.weight = threadWeight_;
+            }
+            if (!force && queue_.size() >= max_ * FAIR_QUEUE_START) {
+                auto weight = queuedWeight_ + (p.queued ? 0 : p.weight) + 1;
+                if (p.queued >= max_ * p.weight / weight) {
+                    return false;
+                }
+            }
+            charge(p);
+            return true;
+        }
+
+        // Under fairMutex_.
+        void charge(Producer& p)
+        {
+            if (!p.queued++) {
+                queuedWeight_ += p.weight;
+            }
+        }
+
+        // Called as the worker pops each record charged for: admitted records, and gap
+        // records, which are charged to the thread that queued them.
+        void release(const Record& r)
+        {
+            if (r.kind == REC_FLUSH) {
+                return;
+            }
+            lock_guard<mutex> lock(fairMutex_);
+            auto it = producers_.find(r.tid);
+            if (it == producers_.end() || !it->second.queued) {
+                return;
+            }
+            auto& p = it->second;
+            if (!--p.queued) {
+                queuedWeight_ -= p.weight;
+                if (!p.dropped) {
+                    producers_.erase(it);
+                }
+            }
+        }
+
+        void blame(uint64_t tid)
+        {
+            lock_guard<mutex> lock(fairMutex_);
+            auto& p = producers_[tid];
+            ++p.dropped;
+            ++p.lost;
+        }
+
+        // Behind everything queued so far, so waiting on the queue waits for the flush too.
+        // A full ring leaves it to the worker to flush once the queue drains.
+        void pushFlush()
+        {
+            Record r;
+            r.kind = REC_FLUSH;
+            if (queue_.push(r)) {
+                ++queued_;
+            }
+            else {
+                flushAsked_ = true;
+            }
+        }
+
+        bool pushGap()
+        {
+            auto lost = lost_.exchange(0);
+            if (!lost) {
+                return true;  // another producer reported them
+            }
+            Record gap;
+            gap.kind = REC_GAP;
+            gap.level = LWARN;
+            gap.ns = lostNs_.load(memory_order_relaxed);
+            gap.file = __FILE__;
+            gap.line = __LINE__;
+            gap.tid = threadId();
+            gap.value = (double)lost;
+            gap.msg = L"dropped " + to_wstring(lost) + L" records";
+            if (fair_) {
+                gap.msg += blamed();
+            }
+            if (fair_) {
+                lock_guard<mutex> lock(fairMutex_);
+                charge(producers_[gap.tid]);
+            }
+            if (!queue_.push(gap)) {
+                if (fair_) {
+                    release(gap);
+                }
+                lost_ += lost;
+                return false;
+            }
+            ++queued_;
+            return true;
+        }
+
+        // The threads that lost records since the last gap, heaviest first.
+        wstring blamed()
+        {
+            vector<pair<uint64_t, uint64_t>> lost;
+            {
+                lock_guard<mutex> lock(fairMutex_);
+                for (auto& it : producers_) {
+                    if (it.second.lost) {
+                        lost.emplace_back(it.second.lost, it.first);
+                        it.second.lost = 0;
+                    }
+                }
+            }
+            sort(lost.rbegin(), lost.rend());
+            wstring ret;
+            for (size_t i = 0; i < lost.size() && i < GAP_BLAME_THREADS; ++i) {
+                ret += (i ? L", thread " : L" (thread ") + to_wstring(lost[i].second) + L": "
+                    + to_wstring(lost[i].first);
+            }
+            if (lost.size() > GAP_BLAME_THREADS) {
+                ret += L", ...";
+            }
+            return ret.empty() ? ret : ret + L")";
+        }
+
+        // Numbers a record the output writes; a gap takes the numbers of the records it
+        // stands for.
+        bool stamp(Record& r)
+        {
+            if (!formatter_.shows(r)) {
+                return false;
+            }
+            r.seq = seq_;
+            seq_ += r.kind == REC_GAP ? (uint64_t)r.value : 1;
+            return true;
+        }
+
+        bool write(Record& r, buffer_type& buf)
+        {
+            buf.clear();
+            if (!stamp(r) || !formatter_.format(r, buf)) {
+                return false;
+            }
+            sink_.write(buf);
+            wrote();
+            if (auto slot = slot_.load(memory_order_acquire)) {
+                account(*slot, r, nowNs());
+            }
+            return true;
+        }
+
+        // Counts a written record for the shared stats segment.
+        void account(SharedOutputStats& slot, const Record& r, int64_t now)
+        {
+            slot.written.fetch_add(1, memory_order_relaxed);
+            if (r.kind == REC_TEXT) {
+                slot.levels[statsLevel(r.level)].fetch_add(1, memory_order_relaxed);
+                latency_.add((double)(now - r.ns));
+            }
+            else if (r.kind == REC_GAP) {
+                gapped_ += (uint64_t)r.value;
+            }
+        }
+
+        // Stores the gauges, and every STATS_PUBLISH_SECONDS the latency quantiles.
+        void publish(SharedOutputStats& slot)
+        {
+            auto now = nowNs();
+            slot.depth.store(queue_.size(), memory_order_relaxed);
+            slot.queued.store(queued_.load(memory_order_relaxed), memory_order_relaxed);
+            slot.dropped.store(gapped_ + lost_.load(memory_order_relaxed), memory_order_relaxed);
+            if (now >= publishDue_ && latency_.count) {
+                slot.latencyP50Ns.store((uint64_t)latency_.quantile(0.5), memory_order_relaxed);
+                slot.latencyP99Ns.store((uint64_t)latency_.quantile(0.99), memory_order_relaxed);
+                slot.latencyMaxNs.store((uint64_t)latency_.max, memory_order_relaxed);
+                latency_ = StatSummary();
+                publishDue_ = now + (int64_t)(STATS_PUBLISH_SECONDS * 1e9);
+            }
+            slot.updatedNs.store(now, memory_order_release);
+        }
+
+        // Starts the staleness clock on the first write since the last flush.
+        void wrote()
+        {
+            if (!dirty_) {
+                dirty_ = true;
+                flushDue_ = chrono::steady_clock::now() + steadyDuration(flushSeconds_);
+            }
+        }
+
+        void flushSink()
+        {
+            sink_.flush();
+            dirty_ = false;
+        }
+
+        // Formats the queued records behind first on the pool, record i on shard i % shards,
+        // and writes them in queue order.  Small batches are not worth the handoff.
+        int writeBatch(Record& first)
+        {
+            size_t shards = pool_->shards();
+            if (batch_.empty()) {
+                batch_.resize(FORMAT_BATCH);
+                formatted_.resize(FORMAT_BATCH);
+                shown_.resize(FORMAT_BATCH);
+                while (formatters_.size() + 1 < shards) {
+                    formatters_.push_back(formatter_);
+                }
+            }
+
+            swap(batch_[0], first);
+            size_t n = 1;
+            size_t popped = 1;
+            bool flush = false;
+            while (n < FORMAT_BATCH && queue_.tryPop(batch_[n])) {
+                ++popped;
+                if (fair_) {
+                    release(batch_[n]);
+                }
+                if (batch_[n].kind == REC_STAT) {
+                    if (statSeconds_ > 0) {
+                        addStat(batch_[n]);
+                    }
+                }
+                else if (batch_[n].kind == REC_FLUSH) {
+                    flush = true;
+                }
+                else {
+                    ++n;
+                }
+            }
+
+            int written = 0;
+            if (alive_) {
+                for (size_t i = 0; i < n; ++i) {
+                    shown_[i] = stamp(batch_[i]);
+                }
+                size_t stride = n >= shards * FORMAT_SHARD_MIN ? shards : 1;
+                auto format = [&](size_t shard) {
+                    auto& f = shard ? formatters_[shard - 1] : formatter_;
+                    for (size_t i = shard; i < n; i += stride) {
+                        formatted_[i].clear();
+                        shown_[i] = shown_[i] && f.format(batch_[i], formatted_[i]);
+                    }
+                };
+                if (stride > 1) {
+                    pool_->run(format);
+                }
+                else {
+                    format(0);
+                }
+                auto slot = slot_.load(memory_order_acquire);
+                auto now = slot ? nowNs() : 0;
+                for (size_t i = 0; i < n; ++i) {
+                    if (shown_[i]) {
+                        sink_.write(formatted_[i]);
+                        ++written;
+                        if (slot) {
+                            account(*slot, batch_[i], now);
+                        }
+                    }
+                }
+                if (written) {
+                    wrote();
+                }
+                if (flush) {
+                    flushSink();
+                }
+            }
+            finish(popped);
+            return written;
+        }
+
+        // Counts records the worker is done with and runs the flushes and syncs they are due
+        // for.  Writes are batched until the oldest unflushed one is flushSeconds old, so a
+        // burst costs few flushes and a quiet period cannot strand a record.  One sync covers
+        // every record written so far, so ERROR statements logged while a sync is running
+        // share the next one.
+        void finish(size_t n)
+        {
+            if (!queue_.size() && flushAsked_.load(memory_order_relaxed)) {
+                flushAsked_ = false;
+                flushSink();
+            }
+            else if (dirty_
+                && ((flushSeconds_ <= 0 && !queue_.size())
+                    || chrono::steady_clock::now() >= flushDue_)) {
+                flushSink();
+            }
+            if (durability_ == DURABLE_PERIODIC && processed_ == synced_) {
+                syncDue_ = chrono::steady_clock::now() + steadyDuration(syncSeconds_);
+            }
+            auto processed = processed_.fetch_add(n) + n;
+            if (durability_ == DURABLE_ERROR) {
+                auto wanted = wanted_.load();
+                if (wanted > synced_
+                    && (processed >= wanted || !queue_.size()
+                        || processed - synced_ >= SYNC_GROUP_MAX)) {
+                    syncSink();
+                }
+            }
+            if (auto slot = slot_.load(memory_order_acquire)) {
+                publish(*slot);
+            }
+            if (reopen_.load() && processed >= reopenAt_.load()) {
+                reopenSink(reopen_.exchange(REOPEN_NONE) == REOPEN_RENAME);
+            }
+            for (size_t i = 0; i < n; ++i) {
+                queue_.done();
+            }
+        }
+
+        // Closes the file with the format's trailer and starts the next with its header.
+        void reopenSink(bool rename)
+        {
+            buffer_type buf;
+            formatter_.end(buf);
+            sink_.write(buf);
+            sink_.reopen(rename);
+            buf.clear();
+            formatter_.begin(buf);
+            sink_.write(buf);
+            dirty_ = false;
+            wrote();
+        }
+
+        void syncSink()
+        {
+            auto start = chrono::steady_clock::now();
+            sink_.sync();
+            dirty_ = false;
+            auto micros = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start);
+            lock_guard<mutex> lock(syncMutex_);
+            durabilityStats_.syncs += 1;
+            durabilityStats_.records += processed_ - synced_;
+            durabilityStats_.syncMicros.add((double)micros.count());
+            synced_ = processed_;
+            syncCv_.notify_all();
+        }
+
+        void addStat(const Record& r)
+        {
+            if (stats_.empty()) {
+                statsDue_ = chrono::steady_clock::now() + steadyDuration(statSeconds_);
+            }
+            auto& st = stats_[r.name];
+            if (!st.count) {
+                st.name = r.name;
+                st.file = r.file;
+                st.line = r.line;
+            }
+            st.add(r.value);
+        }
+
+        // Writes one summary line per metric, sorted by name, and starts a new interval.
+        int writeStats(buffer_type& buf)
+        {
+            vector<const StatSummary*> sorted;
+            for (auto& it : stats_) {
+                sorted.push_back(&it.second);
+            }
+            sort(sorted.begin(), sorted.end(), [](const StatSummary* a, const StatSummary* b) {
+                return strcmp(a->name, b->name) < 0;
+            });
+
+            Record r;
+            r.level = LINFO;
+            r.ns = nowNs();
+            r.tid = threadId();
+            int written = 0;
+            for (auto st : sorted) {
+                r.file = st->file;
+                r.line = st->line;
+                r.msg = st->str();
+                written += write(r, buf);
+            }
+            stats_.clear();
+            return written;
+        }
+
+        void worker()
+        {
+            buffer_type buf;
+
+            formatter_.begin(buf);
+            sink_.write(buf);
+
+            while (alive_) {
+                Record r;
+                bool got = true;
+                bool poll = signalLogging();
+                bool periodic = durability_ == DURABLE_PERIODIC && processed_ > synced_;
+                if (stats_.empty() && !poll && !periodic && !dirty_) {
+                    got = queue_.pop(r);
+                }
+                else {
+                    auto deadline = chrono::steady_clock::time_point::max();
+                    if (poll) {
+                        deadline = chrono::steady_clock::now() + steadyDuration(SIGNAL_POLL_SECONDS);
+                    }
+                    if (!stats_.empty() && statsDue_ < deadline) {
+                        deadline = statsDue_;
+                    }
+                    if (periodic && syncDue_ < deadline) {
+                        deadline = syncDue_;
+                    }
+                    if (dirty_ && flushDue_ < deadline) {
+                        deadline = flushDue_;
+                    }
+                    got = queue_.pop(r, deadline);
+                    auto now = chrono::steady_clock::now();
+                    if (!stats_.empty() && now >= statsDue_) {
+                        writeStats(buf);
+                    }
+                    if (dirty_ && now >= flushDue_) {
+                        flushSink();
+                    }
+                    if (periodic && now >= syncDue_) {
+                        syncSink();
+                    }
+                }
+                if (poll) {
+                    drainSignals();
+                }
+                if (!got) {
+                    continue;
+                }
+                if (fair_) {
+                    release(r);
+                }
+                if (pool_ && r.kind != REC_STAT && r.kind != REC_FLUSH) {
+                    writeBatch(r);
+                    continue;
+                }
+                if (alive_) {
+                    if (r.kind == REC_STAT) {
+                        if (statSeconds_ > 0) {
+                            addStat(r);
+                        }
+                    }
+                    else if (r.kind == REC_FLUSH) {
+                        flushSink();
+                    }
+                    else {
+                        write(r, buf);
+                    }
+                }
+                finish(1);
+            }
+
+            if (!stats_.empty()) {
+                writeStats(buf);
+            }
+
+            buf.clear();
+            formatter_.end(buf);
+            sink_.write(buf);
+            if (durability_ != DURABLE_NONE) {
+                sink_.sync();
+            }
+            else {
+                sink_.flush();
+            }
+        }
+    };
+
+    using TextStreamOutput = BasicOutput<MutexQueue, TextFormat, StreamSink>;
+    using TextFileOutput = BasicOutput<MutexQueue, TextFormat, FileSink>;
+    using TraceFileOutput = BasicOutput<MutexQueue, TraceFormat, FileSink>;
+    using BinaryFileOutput = BasicOutput<MutexQueue, BinaryFormat, FileSink>;
+    using MemoryOutput = BasicOutput<MutexQueue, TextFormat, MemorySink>;
+    using RingFileOutput = BasicOutput<RingQueue, TextFormat, FileSink>;
+
+#if defined(LOGGY_SEPARATE_COMPILATION) && !defined(LOGGY_IMPLEMENTATION)
+    // Instantiated once, in Loggy.cpp.
+    extern template class BasicOutput<MutexQueue, TextFormat, StreamSink>;
+    extern template class BasicOutput<MutexQueue, TextFormat, FileSink>;
+    extern template class BasicOutput<MutexQueue, TraceFormat, FileSink>;
+    extern template class BasicOutput<MutexQueue, BinaryFormat, FileSink>;
+    extern template class BasicOutput<MutexQueue, TextFormat, MemorySink>;
+    extern template class BasicOutput<RingQueue, TextFormat, FileSink>;
+#endif
+
+    // Volume produced by one LOGL call site, keyed by its static __FILE__ and __LINE__.
+    // Bytes count message characters, excluding the layout.
+    struct SiteStats {
+        const char* file = "";
+        int line = 0;
+        uint64_t messages = 0;
+        uint64_t bytes = 0;
+        uint64_t periodMessages = 0;  // since the last periodic report
+        uint64_t periodBytes = 0;
+        uint64_t windowMessages = 0;  // governor load: current and previous window
+        uint64_t lastWindowMessages = 0;
+        uint64_t suppressed = 0;
+        bool throttled = false;
+    };
+
+    struct SiteKey {
+        const char* file;
+        int line;
+
+        bool operator==(const SiteKey& o) const { return file == o.file && line == o.line; }
+    };
+
+    struct SiteKeyHash {
+        size_t operator()(const SiteKey& k) const
+        {
+            return hash<const void*>()(k.file) ^ ((size_t)k.line * 0x9e3779b97f4a7c15ull);
+        }
+    };
+
+#ifndef _WIN32
+    // Serves line commands on a listening Unix domain socket from a thread of its own, one
+    // connection at a time.  A connection idle for CONTROL_IDLE_SECONDS is dropped, so a
+    // stuck client cannot lock others out.
+    class ControlServer {
+    public:
+        ControlServer(int fd, const string& path, function<string(const string&)> handler)
+            : fd_(fd)
+            , path_(path)
+            , handler_(std::move(handler))
+            , thread_(&ControlServer::serve, this)
+        {
+        }
+
+        ControlServer(const ControlServer&) = delete;
+        ControlServer& operator=(const ControlServer&) = delete;
+
+        ~ControlServer()
+        {
+            stop_ = true;
+            thread_.join();
+            ::close(fd_);
+            ::unlink(path_.c_str());
+        }
+
+    private:
+        // Waits up to CONTROL_POLL_SECONDS for fd to become readable.
+        static int readable(int fd)
+        {
+            pollfd p = { fd, POLLIN, 0 };
+            return poll(&p, 1, (int)(CONTROL_POLL_SECONDS * 1000));
+        }
+
+        void serve()
+        {
+            while (!stop_) {
+                if (readable(fd_) <= 0) {
+                    continue;
+                }
+                int c = ::accept(fd_, nullptr, nullptr);
+                if (c >= 0) {
+                    fcntl(c, F_SETFD, FD_CLOEXEC);
+                    session(c);
+                    ::close(c);
+                }
+            }
+        }
+
+        void session(int c)
+        {
+            string in;
+            char buf[512];
+            auto idle = chrono::steady_clock::now();
+            while (!stop_) {
+                int r = readable(c);
+                if (r < 0) {
+                    return;
+                }
+                if (r == 0) {
+                    if (chrono::steady_clock::now() - idle > steadyDuration(CONTROL_IDLE_SECONDS)) {
+                        return;
+                    }
+                    continue;
+                }
+                auto n = ::read(c, buf, sizeof(buf));
+                if (n <= 0) {
+                    return;
+                }
+                idle = chrono::steady_clock::now();
+                in.append(buf, (size_t)n);
+                for (size_t nl; (nl = in.find('\n')) != string::npos;) {
+                    auto line = in.substr(0, nl);
+                    in.erase(0, nl + 1);
+                    if (!line.empty() && line.back() == '\r') {
+                        line.pop_back();
+                    }
+                    if (line == "quit") {
+                        return;
+                    }
+                    if (!send(c, handler_(line))) {
+                        return;
+                    }
+                }
+                if (in.size() > CONTROL_LINE_MAX) {
+                    return;
+                }
+            }
+        }
+
+        static bool send(int c, const string& s)
+        {
+#ifdef MSG_NOSIGNAL
+            const int flags = MSG_NOSIGNAL;
+#else
+            const int flags = 0;
+#endif
+            for (size_t off = 0; off < s.size();) {
+                auto n = ::send(c, s.data() + off, s.size() - off, flags);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    return false;
+                }
+                off += (size_t)n;
+            }
+            return true;
+        }
+
+        int fd_;
+        string path_;
+        function<string(const string&)> handler_;
+        atomic<bool> stop_ { false };
+        std::thread thread_;  // this must be last
+    };
+#endif
+
+    // A file output, shared by every addOutput() naming the same file in the same format.
+    struct SharedFile {
+        wstring path;  // canonical
+        int format;
+        string name;  // path in UTF-8, for getFiles()
+    };
+
+    // The outputs as producers see them.  A set is immutable once published.
+    struct OutputSet {
+        vector<Output*> outputs;  // owned by Log::outputs_
+        size_t durableErrors = 0;  // DURABLE_ERROR outputs
+    };
+
+    // Epoch-based reclamation for what producers read without a lock.  A reader announces
+    // the epoch it entered in on a slot of its own; a writer that swapped something out
+    // advances the epoch and waits until no reader is left in an older one.  Readers never
+    // wait.  Slots are reused by later threads and never freed.
+    class ReadEpoch {
+        struct Slot {
+            atomic<uint64_t> epoch { 0 };  // 0 outside read sections
+            atomic<bool> used { true };
+            Slot* next = nullptr;
+        };
+
+    public:
+        class Guard {
+        public:
+            explicit Guard(ReadEpoch& epoch)
+                : slot_(epoch.slot())
+            {
+                slot_.epoch.store(epoch.epoch_.load());
+            }
+
+            Guard(const Guard&) = delete;
+            Guard& operator=(const Guard&) = delete;
+
+            ~Guard() { slot_.epoch.store(0, memory_order_release); }
+
+        private:
+            Slot& slot_;
+        };
+
+        // Returns once every reader that could still see what was swapped out has left.
+        void synchronize()
+        {
+            auto epoch = epoch_.fetch_add(1);
+            for (auto s = slots_.load(); s; s = s->next) {
+                for (;;) {
+                    auto e = s->epoch.load(memory_order_acquire);
+                    if (!e || e > epoch) {
+                        break;
+                    }
+                    this_thread::yield();
+                }
+            }
+        }
+
+    private:
+        // Hands the thread's slot back when the thread exits.
+        struct Owner {
+            Slot* slot = nullptr;
+            ~Owner()
+            {
+                if (slot) {
+                    slot->used.store(false, memory_order_release);
+                }
+            }
+        };
+
+        Slot& slot()
+        {
+            thread_local Owner owner;
+            if (!owner.slot) {
+                for (auto s = slots_.load(); s; s = s->next) {
+                    bool used = false;
+                    if (s->used.compare_exchange_strong(used, true)) {
+                        owner.slot = s;
+                        return *s;
+                    }
+                }
+                auto s = new Slot;
+                s->next = slots_.load();
+                while (!slots_.compare_exchange_weak(s->next, s)) {
+                }
+                owner.slot = s;
+            }
+            return *owner.slot;
+        }
+
+        atomic<uint64_t> epoch_ { 1 };
+        atomic<Slot*> slots_ { nullptr };
+    };
+
+    // Capture state of the innermost RequestScope on a thread.
+    struct RequestBuffer {
+        RequestBuffer* outer = nullptr;
+        int floor = LDEBUG;  // lowest captured level; captured levels are below LINFO
+        size_t max = REQUEST_BUF_CNT;
+        size_t discarded = 0;
+        deque<Record> records;
+
+        bool captures(int level) const { return level >= floor && level < LINFO; }
+
+        // Keeps the most recent records when over max.
+        void add(Record&& r)
+        {
+            if (max && records.size() >= max) {
+                records.pop_front();
+                ++discarded;
+            }
+            records.push_back(std::move(r));
+        }
+    };
+
+    class Log {
+    public:
+        ~Log()
+        {
+#ifndef _WIN32
+            control_.reset();  // first: its commands use the rest
+#endif
+            resetOutput();
+            {
+                // the default output's worker polls for signal records until it is joined
+                lock_guard<LogMutex> lock(mutex_);
+                closing_ = true;
+            }
+            delete published_.load();
+#ifndef _WIN32
+            if (shared_) {
+                munmap(shared_, sizeof(SharedStats));
+                shm_unlink(sharedName_.c_str());
+            }
+#endif
+        };
+
+        int trigFrom_ = LINVALID;
+        int trigTo_ = LINVALID;
+        int trigCnt_ = LINVALID;
+        string timeFormat_ = DEFAULT_TIME_FMT;
+        string name_;
+        LogMutex mutex_;
+
+        atomic<bool> siteProfiling_ { false };
+        int64_t siteReportNs_ = 0;
+        int64_t nextSiteReport_ = 0;
+        size_t siteReportTop_ = 0;
+        unordered_map<SiteKey, SiteStats, SiteKeyHash> sites_;
+
+        SignalRing signals_;
+        atomic<bool> signalLogging_ { false };
+        bool closing_ = false;  // set by ~Log under mutex_: nothing left to drain into
+
+        atomic<int> stackLevel_ { LMAX + 1 };
+        atomic<size_t> stackDepth_ { STACK_FRAMES };
+
+        bool governor_ = false;
+        double highWater_ = 0;
+        double lowWater_ = 0;
+        int64_t nextGovern_ = 0;
+        size_t throttledSites_ = 0;
+
+        // Reconfiguration happens under mutex_ and publishes a new OutputSet; producers read
+        // the published one without the lock.
+        vector<unique_ptr<Output>> outputs_;
+        unique_ptr<Output> default_output_;
+        size_t durableErrors_ = 0;  // DURABLE_ERROR outputs
+        atomic<const OutputSet*> published_ { new OutputSet };
+        ReadEpoch epoch_;
+
+        SharedStats* shared_ = nullptr;  // slot i belongs to outputs_[i]
+        string sharedName_;
+#ifndef _WIN32
+        unique_ptr<ControlServer> control_;
+#endif
+
+        // Levels set for files matching a pattern, under mutex_; the last match wins.  Threads
+        // cache the level of each file until fileLevelGen_ moves on.
+        struct FileLevel {
+            string pattern;
+            int level;
+        };
+        int baseLevel_ = LINFO;
+        vector<FileLevel> fileLevels_;
+        atomic<unsigned> fileLevelGen_ { 1 };
+        atomic<bool> fileLevelsOn_ { false };
+        deque<SharedFile> files_;  // deque: getFiles() hands out the names' c_str()
+
+        vector<wstring> buffer_;
+
+        // The default output, like the others, starts its thread with its first record.
+        Log()
+            : default_output_(new TextStreamOutput(wcout, makeConfig(LINFO, 1))) {};
+
+        bool isLevel(int level) { return Loggy::isLevel(level); }
+
+        // For signal handlers: the logger level alone.  isLevel() also reads the thread's
+        // capture state, and a thread_local in a dlopen'ed library may allocate on first use.
+        bool isSignalLevel(int level) { return level >= logLevel_.load(memory_order_relaxed); }
+
+        // The innermost RequestScope on this thread; captureFloor_ mirrors its floor.
+        static RequestBuffer*& requestBuffer()
+        {
+            thread_local RequestBuffer* rb = nullptr;
+            return rb;
+        }
+
+        // Writes out what the outputs hold, records from signal handlers included (the workers
+        // can't drain those while the lock is held), then closes them.
+        void resetOutput()
+        {
+            lock_guard<LogMutex> lock(mutex_);
+            if (signalLogging_) {
+                moveSignals();
+            }
+            for (auto& out : outputs_) {
+                out->sync();
+            }
+            for (auto& out : outputs_) {
+                out->wait();
+            }
+            {
+                auto retired = std::move(outputs_);
+                outputs_.clear();
+                files_.clear();
+                durableErrors_ = 0;
+                tracing_ = false;
+                publish();
+            }  // retired outputs close here, once no producer can reach them
+            if (shared_) {
+                shared_->outputs = 0;
+                for (auto& slot : shared_->output) {
+                    clearSlot(slot);
+                }
+            }
+        }
+
+        bool enableSharedStats(const string& name)
+        {
+#ifdef _WIN32
+            (void)name;
+            return false;
+#else
+            lock_guard<LogMutex> lock(mutex_);
+            if (shared_) {
+                return true;
+            }
+            sharedName_ = name.empty() ? "/loggy-" + to_string(getpid()) : name;
+            int fd = shm_open(sharedName_.c_str(), O_CREAT | O_RDWR, 0644);
+            if (fd < 0) {
+                return false;
+            }
+            void* p = MAP_FAILED;
+            if (ftruncate(fd, sizeof(SharedStats)) == 0) {
+                p = mmap(nullptr, sizeof(SharedStats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            }
+            ::close(fd);
+            if (p == MAP_FAILED) {
+                shm_unlink(sharedName_.c_str());
+                return false;
+            }
+            shared_ = new (p) SharedStats();
+            shared_->version = STATS_VERSION;
+            shared_->pid = (uint64_t)getpid();
+            for (size_t i = 0; i < outputs_.size(); ++i) {
+                shareStats(i);
+            }
+            atomic_thread_fence(memory_order_release);
+            shared_->magic = STATS_MAGIC;  // last: readers check it
+            return true;
+#endif
+        }
+
+        // Under mutex_.
+        void shareStats(size_t i)
+        {
+            if (shared_ && i < STATS_OUTPUTS) {
+                outputs_[i]->publishStats(&shared_->output[i]);
+                shared_->outputs = (uint32_t)i + 1;
+            }
+        }
+
+        bool enableControlSocket(const string& path)
+        {
+#ifdef _WIN32
+            (void)path;
+            return false;
+#else
+            lock_guard<LogMutex> lock(mutex_);
+            if (control_) {
+                return true;
+            }
+            auto p = path.empty() ? "/tmp/loggy-" + to_string(getpid()) + ".sock" : path;
+            sockaddr_un addr = {};
+            if (p.size() >= sizeof(addr.sun_path)) {
+                return false;
+            }
+            addr.sun_family = AF_UNIX;
+            memcpy(addr.sun_path, p.c_str(), p.size() + 1);
+            int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (fd < 0) {
+                return false;
+            }
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            bool bound = ::bind(fd, (sockaddr*)&addr, sizeof(addr)) == 0;
+            if (!bound && errno == EADDRINUSE && staleSocket(addr)) {
+                ::unlink(p.c_str());
+                bound = ::bind(fd, (sockaddr*)&addr, sizeof(addr)) == 0;
+            }
+            // nobody can connect before listen(), so the mode is narrowed in time
+            if (!bound || chmod(p.c_str(), 0600) != 0 || listen(fd, 4) != 0) {
+                ::close(fd);
+                if (bound) {
+                    ::unlink(p.c_str());
+                }
+                return false;
+            }
+            control_.reset(new ControlServer(fd, p, [this](const string& c) { return command(c); }));
+            return true;
+#endif
+        }
+
+#ifndef _WIN32
+        // True if addr is left over from a process that is gone: nothing accepts on it.
+        static bool staleSocket(const sockaddr_un& addr)
+        {
+            int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (fd < 0) {
+                return false;
+            }
+            bool stale = ::connect(fd, (const sockaddr*)&addr, sizeof(addr)) != 0 && errno == ECONNREFUSED;
+            ::close(fd);
+            return stale;
+        }
+#endif
+
+        // Under mutex_.  Swaps in a set of the current outputs and frees the old one once
+        // the producers that might be using it are done.
+        void publish()
+        {
+            auto set = new OutputSet;
+            for (auto& out : outputs_) {
+                set->outputs.push_back(out.get());
+            }
+            set->durableErrors = durableErrors_;
+            auto old = published_.exchange(set);
+            epoch_.synchronize();
+            delete old;
+        }
+
+        // Fills in the logger-wide defaults left empty in an output configuration.
+        OutputConfig makeConfig(OutputConfig config)
+        {
+            if (config.timeFormat.empty())
+                config.timeFormat = timeFormat_;
+            if (config.name.empty())
+                config.name = name_;
+            return config;
+        }
+
+        OutputConfig makeConfig(int level, size_t bufferSize)
+        {
+            OutputConfig config;
+            config.level = level;
+            config.bufferSize = bufferSize;
+            return makeConfig(config);
+        }
+
+        // Builds the mutex-queued output for config.format writing to target.
+        template <class Sink, class Target>
+        static unique_ptr<Output> makeOutput(Target& target, const OutputConfig& config)
+        {
+            switch (config.format) {
+            case FORMAT_TRACE:
+                return unique_ptr<Output>(
+                    new BasicOutput<MutexQueue, TraceFormat, Sink>(target, config));
+            case FORMAT_BINARY:
+                return unique_ptr<Output>(
+                    new BasicOutput<MutexQueue, BinaryFormat, Sink>(target, config));
+            default:
+                return unique_ptr<Output>(new BasicOutput<MutexQueue, TextFormat, Sink>(target, config));
+            }
+        }
+
+        void addOutput(unique_ptr<Output> out, const OutputConfig& config)
+        {
+            lock_guard<LogMutex> lock(mutex_);
+            attach(std::move(out), config);
+        }
+
+        // Under mutex_.
+        void attach(unique_ptr<Output> out, const OutputConfig& config)
+        {
+            if (signalLogging_) {
+                out->start();
+            }
+            outputs_.push_back(std::move(out));
+            shareStats(outputs_.size() - 1);
+            tracing_ = tracing_ || outputs_.back()->traces();
+            durableErrors_ += config.durability == DURABLE_ERROR;
+            publish();
+        }
+
+        // Outputs are shared per file and format: adding a file that is already written in the
+        // same format, under any spelling of its path, keeps the first output's queue, thread,
+        // handle and configuration.
+        void addOutput(const wstring& path, const OutputConfig& config)
+        {
+            auto c = makeConfig(config);
+            auto canonical = canonicalPath(path);
+            lock_guard<LogMutex> lock(mutex_);
+            for (auto& f : files_) {
+                if (f.path == canonical && f.format == c.format) {
+                    return;
+                }
+            }
+            attach(makeOutput<FileSink>(canonical, c), c);
+            files_.push_back({ canonical, c.format, w2str(canonical) });
+        }
+
+        void addOutput(wostream& stream, const OutputConfig& config)
+        {
+            auto c = makeConfig(config);
+            addOutput(makeOutput<StreamSink>(stream, c), c);
+        }
+
+        void addOutput(const wstring& path, int level, int bufferSize)
+        {
+            addOutput(path, makeConfig(level, bufferSize));
+        }
+
+        void addOutput(wostream& stream, int level, int bufferSize)
+        {
+            addOutput(stream, makeConfig(level, bufferSize));
+        }
+
+        // Canonical paths of the file outputs, valid until resetOutput().
         std::vector<const char*> getFiles()
         {
-            std::vector<const char*> ret;
-            return ret;
+            lock_guard<LogMutex> lock(mutex_);
+            std::vector<const char*> ret;
+            for (auto& f : files_) {
+                ret.push_back(f.name.c_str());
+            }
+            return ret;
+        }
+
+        void setTrigger(int levelFrom, int levelTo, int lookbackCount)
+        {
+            trigFrom_ = levelFrom;
+            trigTo_ = levelTo;
+            trigCnt_ = lookbackCount;
+        }
+
+        void setLevel(int level)
+        {
+            lock_guard<LogMutex> lock(mutex_);
+            baseLevel_ = level;
+            updateLevels();
+        }
+
+        // Sets the level of the files whose __FILE__ matches pattern, see globMatch().
+        void setLevel(int level, const string& pattern)
+        {
+            lock_guard<LogMutex> lock(mutex_);
+            auto it = find_if(fileLevels_.begin(), fileLevels_.end(),
+                [&](const FileLevel& f) { return f.pattern == pattern; });
+            if (it != fileLevels_.end()) {
+                fileLevels_.erase(it);
+            }
+            fileLevels_.push_back({ pattern, level });
+            updateLevels();
+        }
+
+        void clearFileLevels()
+        {
+            lock_guard<LogMutex> lock(mutex_);
+            fileLevels_.clear();
+            updateLevels();
         }
 
-        void setTrigger(int levelFrom, int levelTo, int lookbackCount)
+        // Under mutex_.  The macros test logLevel_, so it holds the lowest level in effect
+        // anywhere, and writer() applies the file's own.
+        void updateLevels()
         {
-            trigFrom_ = levelFrom;
-            trigTo_ = levelTo;
-            trigCnt_ = lookbackCount;
+            int level = baseLevel_;
+            for (auto& f : fileLevels_) {
+                level = (std::min)(level, f.level);
+            }
+            fileLevelsOn_ = !fileLevels_.empty();
+            ++fileLevelGen_;
+            logLevel_ = level;
+        }
+
+        int fileLevel(const char* file)
+        {
+            struct Cached {
+                unsigned gen = 0;
+                int level = 0;
+            };
+            thread_local unordered_map<const char*, Cached> cache;
+            auto& c = cache[file];
+            if (c.gen != fileLevelGen_.load(memory_order_acquire)) {
+                lock_guard<LogMutex> lock(mutex_);
+                c.level = baseLevel_;
+                for (auto it = fileLevels_.rbegin(); it != fileLevels_.rend(); ++it) {
+                    if (globMatch(it->pattern.c_str(), file)) {
+                        c.level = it->level;
+                        break;
+                    }
+                }
+                c.gen = fileLevelGen_.load(memory_order_relaxed);
+            }
+            return c.level;
         }
 
-        void setLevel(int level) { level_ = level; }
+        // Applies to outputs added afterwards: the name is compiled into their layouts.
+        void setName(const string& name) { name_ = name; }
 
         struct LastLog {
             wstringstream ws;
-            time_t tm = 0;
+            int level = LINVALID;
+            int64_t ns = 0;
+            const char* file = "";
+            int line = 0;
+            int floor = LINFO;   // the level in effect for file
+            bool muted = false;  // below floor and not captured: formatting is skipped
+            string blob;         // hexdump()s, see operator<<(wostream&, const Blob&)
+            vector<BlobRef> blobs;
         };
 
         static LastLog& lastLog()
@@ -353,90 +3417,794 @@ namespace Loggy {
             return ll_;
         }
 
-        static const char* basename(const char* file)
+        // Creates what a thread's first statement would: the statement stream, with room for
+        // reserve characters, the thread id, the read-section slot and the profiler's
+        // counters.  The allocation also sets up the thread's malloc arena.  Then faults in
+        // the stack a statement runs on.
+        void prepareThread(size_t reserve)
         {
-            const char* b = strrchr(file, '\\');
-            if (!b)
-                b = strrchr(file, '/');
-            return b ? b + 1 : file;
+            auto& ll = lastLog();
+            ll.ws.str(wstring(reserve, L' '));  // str(L"") in writer() keeps the capacity
+            ll.ws << 0 << 0.5 << L"";
+            ll.ws.str(L"");
+            ll.ws.clear();
+            threadId();
+            nowNs();
+            requestBuffer();
+            { ReadEpoch::Guard guard(epoch_); }
+#ifdef LOGGY_LOCK_PROFILE
+            for (int i = 0; i < PROF_MAX; ++i) {
+                Profiler::counter(i);
+            }
+#endif
+            prefaultStack();
+        }
+
+        static LOGGY_NOINLINE void prefaultStack()
+        {
+            volatile char stack[THREAD_STACK_PREFAULT];
+            for (size_t i = 0; i < sizeof(stack); i += 1024) {
+                stack[i] = 0;
+            }
         }
 
-        static const char* levelname(int level) { return levelNames_[level].c_str(); }
+        static const char* basename(const char* file) { return baseName(file); }
+
+        static const char* levelname(int level) { return levelName(level); }
 
-        wostream& writer(int level, const char* file, int line)
+        LOGGY_COLD LOGGY_NOINLINE wostream& writer(int level, const char* file, int line)
         {
+            _LOGGY_PROFILE_SCOPE(PROF_WRITER);
             auto& ll = lastLog();
-            time(&ll.tm);
-            ll.ws.clear();
+            ll.ns = nowNs();
+            ll.level = level;
+            ll.file = file;
+            ll.line = line;
+            ll.floor = fileLevelsOn_.load(memory_order_relaxed) ? fileLevel(file)
+                                                                 : logLevel_.load(memory_order_relaxed);
+            ll.muted = level < ll.floor && !(level < LINFO && level >= captureFloor_);
+            ll.ws.clear(ll.muted ? ios::badbit : ios::goodbit);
             ll.ws.str(L"");
-            return ll.ws << timestamp(timeFormat_.c_str(), ll.tm).c_str() << " " << basename(file)
-                << ":" << line << " " << levelname(level) << " ";
+            ll.blob.clear();
+            ll.blobs.clear();
+            return ll.ws;
         }
 
-        void queue()
+        LOGGY_COLD LOGGY_NOINLINE void queue()
         {
-            lock_guard<mutex> lock(mutex_);
+            _LOGGY_PROFILE_SCOPE(PROF_QUEUE);
             auto& ll = lastLog();
-            auto s = ll.ws.str();
+            if (ll.muted) {
+                return;
+            }
+            Record r;
+            r.level = ll.level;
+            r.ns = ll.ns;
+            r.file = ll.file;
+            r.line = ll.line;
+            r.tid = threadId();
+            r.msg = ll.ws.str();
+            if (!ll.blobs.empty()) {
+                r.blob = ll.blob;
+                r.blobs = ll.blobs;
+            }
+
+            auto rb = requestBuffer();
+            if (rb && rb->captures(r.level)) {
+                rb->add(std::move(r));
+                return;
+            }
+            if (r.level < ll.floor) {
+                return;  // enabled only for capture by a request scope
+            }
+            if (r.level >= stackLevel_.load(memory_order_relaxed)) {
+                captureStack(r.frames, stackDepth_.load(memory_order_relaxed), _LOGGY_RETURN_ADDRESS());
+            }
+            push(r);
+        }
+
+        // Per call site accounting of log statements, off by default.
+        void setSiteProfiling(bool enable)
+        {
+            lock_guard<LogMutex> lock(mutex_);
+            siteProfiling_ = enable;
+        }
+
+        // Writes the topN sites of each period to the outputs; 0 seconds stops the reports.
+        void setSiteReport(double seconds, size_t topN)
+        {
+            lock_guard<LogMutex> lock(mutex_);
+            siteProfiling_ = siteProfiling_ || seconds > 0;
+            siteReportNs_ = (int64_t)(seconds * 1e9);
+            siteReportTop_ = topN;
+            nextSiteReport_ = nowNs() + siteReportNs_;
+        }
+
+        void resetSiteStats()
+        {
+            lock_guard<LogMutex> lock(mutex_);
+            sites_.clear();
+        }
+
+        // Sites sorted by bytes, busiest first.
+        vector<SiteStats> siteStats(size_t topN)
+        {
+            lock_guard<LogMutex> lock(mutex_);
+            return topSites(topN, false);
+        }
+
+        vector<SiteStats> topSites(size_t topN, bool period)
+        {
+            vector<SiteStats> ret;
+            for (auto& it : sites_) {
+                ret.push_back(it.second);
+            }
+            auto bytes = [period](const SiteStats& s) { return period ? s.periodBytes : s.bytes; };
+            sort(ret.begin(), ret.end(),
+                [&](const SiteStats& a, const SiteStats& b) { return bytes(a) > bytes(b); });
+            if (ret.size() > topN) {
+                ret.resize(topN);
+            }
+            while (period && !ret.empty() && !ret.back().periodMessages) {
+                ret.pop_back();
+            }
+            return ret;
+        }
+
+        // Opt-in load shedding: once some output queue is filled above highWater (a fraction
+        // of its buffer size), the heaviest call sites below ERROR are muted, a few more each
+        // GOVERNOR_SECONDS while the pressure lasts, and all are released together once every
+        // queue is back under lowWater.  Enables site profiling.
+        void setGovernor(bool enable, double highWater = 0.75, double lowWater = 0.25)
+        {
+            lock_guard<LogMutex> lock(mutex_);
+            siteProfiling_ = siteProfiling_ || enable;
+            governor_ = enable;
+            highWater_ = highWater;
+            lowWater_ = lowWater;
+            if (!enable) {
+                release(nowNs());
+            }
+        }
+
+        void setStackTraces(int level, size_t depth)
+        {
+#ifdef _LOGGY_BACKTRACE
+            // glibc loads its unwinder on the first backtrace(), which must not be a crash
+            void* frame;
+            backtrace(&frame, 1);
+#endif
+            stackDepth_ = depth;
+            stackLevel_ = level;
+        }
+
+        double pressure()
+        {
+            double p = 0;
+            for (auto& out : outputs_) {
+                p = (std::max)(p, out->pressure());
+            }
+            return p;
+        }
+
+        void notice(int level, int64_t ns, const wstring& msg)
+        {
+            Record r;
+            r.level = level;
+            r.ns = ns;
+            r.file = __FILE__;
+            r.line = __LINE__;
+            r.tid = threadId();
+            r.msg = msg;
+            for (auto& out : outputs_) {
+                out->add(r, true);
+            }
+        }
+
+        void govern(int64_t ns)
+        {
+            nextGovern_ = ns + (int64_t)(GOVERNOR_SECONDS * 1e9);
+            double p = pressure();
+
+            if (p >= highWater_ && throttledSites_ < sites_.size()) {
+                // mute the heaviest sites until they cover half the recent load
+                vector<SiteStats*> heavy;
+                uint64_t total = 0;
+                for (auto& it : sites_) {
+                    auto& st = it.second;
+                    total += st.windowMessages + st.lastWindowMessages;
+                    if (!st.throttled && (st.windowMessages || st.lastWindowMessages)) {
+                        heavy.push_back(&st);
+                    }
+                }
+                sort(heavy.begin(), heavy.end(), [](const SiteStats* a, const SiteStats* b) {
+                    return a->windowMessages + a->lastWindowMessages
+                        > b->windowMessages + b->lastWindowMessages;
+                });
+                uint64_t covered = 0;
+                for (size_t i = 0; i < heavy.size() && i < GOVERNOR_MAX_SITES && covered * 2 < total;
+                     ++i) {
+                    auto& st = *heavy[i];
+                    covered += st.windowMessages + st.lastWindowMessages;
+                    st.throttled = true;
+                    st.suppressed = 0;
+                    ++throttledSites_;
+                    wstringstream ws;
+                    ws << "throttling " << baseName(st.file) << ":" << st.line << " below ERROR ("
+                       << st.windowMessages + st.lastWindowMessages << " recent messages, queue at "
+                       << (int)(p * 100) << "%)";
+                    notice(LWARN, ns, ws.str());
+                }
+            }
+            else if (p <= lowWater_) {
+                release(ns);
+            }
+
+            for (auto& it : sites_) {
+                it.second.lastWindowMessages = it.second.windowMessages;
+                it.second.windowMessages = 0;
+            }
+        }
+
+        void release(int64_t ns)
+        {
+            if (!throttledSites_) {
+                return;
+            }
+            for (auto& it : sites_) {
+                auto& st = it.second;
+                if (st.throttled) {
+                    wstringstream ws;
+                    ws << "released " << baseName(st.file) << ":" << st.line << ", "
+                       << st.suppressed << " messages suppressed";
+                    notice(LWARN, ns, ws.str());
+                    st.throttled = false;
+                    st.suppressed = 0;
+                }
+            }
+            throttledSites_ = 0;
+        }
+
+        // Returns false if the governor mutes the record's site.
+        bool countSite(const Record& r)
+        {
+            auto& st = sites_[SiteKey { r.file, r.line }];
+            st.file = r.file;
+            st.line = r.line;
+            if (governor_) {
+                // ahead of the muting, so a site still throttled once the queues drain is
+                // released by its own next statement
+                if (r.ns >= nextGovern_) {
+                    govern(r.ns);
+                }
+                if (st.throttled && r.level < LERROR) {
+                    ++st.suppressed;
+                    return false;
+                }
+                st.windowMessages += 1;
+            }
+            st.messages += 1;
+            st.bytes += r.msg.size();
+            st.periodMessages += 1;
+            st.periodBytes += r.msg.size();
+
+            if (siteReportNs_ && r.ns >= nextSiteReport_) {
+                nextSiteReport_ = r.ns + siteReportNs_;
+                reportSites(r.ns);
+            }
+            return true;
+        }
+
+        void reportSites(int64_t ns)
+        {
+            Record rep;
+            rep.level = LINFO;
+            rep.ns = ns;
+            rep.file = __FILE__;
+            rep.line = __LINE__;
+            rep.tid = threadId();
+            for (auto& st : topSites(siteReportTop_, true)) {
+                wstringstream ws;
+                ws << "site " << baseName(st.file) << ":" << st.line << " messages=" << st.periodMessages
+                   << " bytes=" << st.periodBytes;
+                rep.msg = ws.str();
+                dispatch(rep);
+            }
+            for (auto& it : sites_) {
+                it.second.periodMessages = 0;
+                it.second.periodBytes = 0;
+            }
+        }
+
+        // Hands a record to every output without taking mutex_, unless site profiling is on.
+        // ERROR statements return once DURABLE_ERROR outputs have synced them.
+        void push(const Record& r)
+        {
+            if (siteProfiling_.load(memory_order_relaxed) && r.kind == REC_TEXT) {
+                lock_guard<LogMutex> lock(mutex_);
+                if (!countSite(r)) {
+                    return;
+                }
+            }
+            vector<pair<Output*, uint64_t>> tickets;
+            {
+                ReadEpoch::Guard guard(epoch_);
+                auto& set = *published_.load(memory_order_acquire);
+                dispatch(set, r);
+                if (set.durableErrors && r.kind == REC_TEXT && r.level >= LERROR) {
+                    for (auto out : set.outputs) {
+                        if (auto t = out->ticket()) {
+                            tickets.emplace_back(out, t);
+                        }
+                    }
+                }
+            }
+            // an output with waiters outlives them, see ~BasicOutput
+            for (auto& t : tickets) {
+                t.first->waitDurable(t.second);
+            }
+        }
+
+        vector<vector<ProducerStats>> producerStats()
+        {
+            lock_guard<LogMutex> lock(mutex_);
+            vector<vector<ProducerStats>> ret;
+            vector<ProducerStats> st;
+            for (auto& out : outputs_) {
+                if (out->producerStats(st)) {
+                    ret.push_back(st);
+                }
+            }
+            return ret;
+        }
+
+        vector<DurabilityStats> durabilityStats()
+        {
+            lock_guard<LogMutex> lock(mutex_);
+            vector<DurabilityStats> ret;
+            DurabilityStats st;
+            for (auto& out : outputs_) {
+                if (out->durabilityStats(st)) {
+                    ret.push_back(st);
+                }
+            }
+            return ret;
+        }
 
-            if (outputs_.empty()) {
-                default_output_.add(s, ll.tm);
+        // Under mutex_, which keeps the published set.
+        void dispatch(const Record& r) { dispatch(*published_.load(memory_order_relaxed), r); }
+
+        void dispatch(const OutputSet& set, const Record& r)
+        {
+            if (set.outputs.empty()) {
+                default_output_->add(r);
             }
             else {
-                for (auto& out : outputs_) {
-                    out.add(s, ll.tm);
+                for (auto out : set.outputs) {
+                    out->add(r);
                 }
             }
         }
+        // Outputs start on their first record, but signal records are drained by polling
+        // workers, so those must run from now on.
+        void enableSignalLogging()
+        {
+            lock_guard<LogMutex> lock(mutex_);
+            signalLogging_ = true;
+            default_output_->start();
+            for (auto& out : outputs_) {
+                out->start();
+            }
+        }
+
+        // Moves records logged from signal handlers to the outputs.  Only try-locks, as the
+        // callers are output workers which resetOutput() may be joining under the lock.
+        void drainSignals()
+        {
+            if (signals_.idle()) {
+                return;
+            }
+            unique_lock<LogMutex> lock(mutex_, try_to_lock);
+            if (!lock.owns_lock() || closing_) {
+                return;
+            }
+            moveSignals();
+        }
+
+        // Under mutex_.  Hands the records logged from signal handlers to the outputs.
+        void moveSignals()
+        {
+            Record r;
+            while (signals_.pop(r)) {
+                dispatch(r);
+            }
+            if (auto dropped = signals_.takeDropped()) {
+                wstringstream ws;
+                ws << "dropped " << dropped << " signal handler records";
+                notice(LWARN, nowNs(), ws.str());
+            }
+        }
+
         void wait_queues()
         {
-            if (outputs_.empty()) {
-                default_output_.wait();
+            {
+                lock_guard<LogMutex> lock(mutex_);
+                if (signalLogging_) {
+                    moveSignals();
+                }
+                default_output_->sync();
+                for (auto& out : outputs_) {
+                    out->sync();
+                }
+            }
+            // waits without mutex_, on the published set: outputs it holds outlive the guard,
+            // as resetOutput() frees them only after publish() has seen the guard go
+            ReadEpoch::Guard guard(epoch_);
+            auto& set = *published_.load(memory_order_acquire);
+            if (set.outputs.empty()) {
+                default_output_->wait();
             }
             else {
+                for (auto out : set.outputs) {
+                    out->wait();
+                }
+            }
+        }
+
+        // Closes and reopens the output files, renaming them first if rename is set, and
+        // returns once that is done.  Returns the outputs that refused, see Output::reopen().
+        vector<string> reopen(bool rename)
+        {
+            vector<string> refused;
+            {
+                lock_guard<LogMutex> lock(mutex_);
                 for (auto& out : outputs_) {
-                    out.wait();
+                    if (!out->reopen(rename)) {
+                        refused.push_back(out->name());
+                    }
+                }
+            }
+            wait_queues();
+            return refused;
+        }
+
+        static int parseLevel(const string& s)
+        {
+            if (!s.empty() && s.find_first_not_of("0123456789") == string::npos) {
+                return atoi(s.c_str());
+            }
+            string name = s;
+            for (auto& c : name) {
+                c = (char)toupper((unsigned char)c);
+            }
+            for (auto& it : levelNames_) {
+                if (it.first != LINVALID && it.second == name) {
+                    return it.first;
+                }
+            }
+            return LINVALID;
+        }
+
+        // Runs one line of the control protocol and returns its reply: any output lines, then
+        // "ok" or "error: ...".
+        string command(const string& line)
+        {
+            istringstream in(line);
+            string cmd, arg, pattern;
+            in >> cmd >> arg >> pattern;
+            ostringstream out;
+            if (cmd.empty()) {
+                return string();
+            }
+            else if (cmd == "help") {
+                out << "level                    show the levels\n"
+                       "level LEVEL [PATTERN]    set the level, or that of files matching PATTERN\n"
+                       "level clear              drop the file levels\n"
+                       "flush                    write out the queues\n"
+                       "rotate                   rename the files with a timestamp and reopen them\n"
+                       "reopen                   reopen the files, after an external rotation; not trace files\n"
+                       "stats                    show the output counters\n"
+                       "quit                     close the connection\n";
+            }
+            else if (cmd == "level" && arg.empty()) {
+                lock_guard<LogMutex> lock(mutex_);
+                out << "level " << levelName(baseLevel_) << "\n";
+                for (auto& f : fileLevels_) {
+                    out << "level " << levelName(f.level) << " " << f.pattern << "\n";
+                }
+            }
+            else if (cmd == "level" && arg == "clear") {
+                clearFileLevels();
+            }
+            else if (cmd == "level") {
+                int level = parseLevel(arg);
+                if (level == LINVALID) {
+                    return "error: unknown level " + arg + "\n";
+                }
+                if (pattern.empty()) {
+                    setLevel(level);
+                }
+                else {
+                    setLevel(level, pattern);
+                }
+            }
+            else if (cmd == "flush") {
+                wait_queues();
+            }
+            else if (cmd == "rotate" || cmd == "reopen") {
+                auto refused = reopen(cmd == "rotate");
+                if (!refused.empty()) {
+                    string names;
+                    for (auto& name : refused) {
+                        names += " " + name;
+                    }
+                    return "error: one document per file, rotate instead:" + names + "\n";
+                }
+            }
+            else if (cmd == "stats") {
+                stats(out);
+            }
+            else if (cmd == "dump") {
+                return "error: no lookback buffer to dump\n";
+            }
+            else {
+                return "error: unknown command " + cmd + ", try help\n";
+            }
+            out << "ok\n";
+            return out.str();
+        }
+
+        void stats(ostream& out)
+        {
+            lock_guard<LogMutex> lock(mutex_);
+            DurabilityStats d;
+            vector<ProducerStats> producers;
+            for (auto& o : outputs_) {
+                out << "output " << o->name() << " pressure=" << o->pressure() << "\n";
+                if (o->durabilityStats(d)) {
+                    out << "  syncs=" << d.syncs << " records=" << d.records
+                        << " sync_p99_us<=" << d.syncMicros.quantile(0.99)
+                        << " wait_p99_us<=" << d.waitMicros.quantile(0.99) << "\n";
+                }
+                if (o->producerStats(producers)) {
+                    for (auto& p : producers) {
+                        out << "  thread " << p.tid << " weight=" << p.weight << " queued=" << p.queued
+                            << " dropped=" << p.dropped << "\n";
+                    }
+                }
+            }
+            if (siteProfiling_) {
+                for (auto& st : topSites(10, false)) {
+                    out << "site " << baseName(st.file) << ":" << st.line
+                        << " messages=" << st.messages << " bytes=" << st.bytes << "\n";
                 }
             }
         }
     };
 
-    static Log& getInstance()
+    inline Log& getInstance()
     {
         static Log l;
         return l;
     }
 
-    void resetOutput() { getInstance().resetOutput(); }
+    // Adds an output of any policy combination, e.g.
+    //   addOutput<BasicOutput<RingQueue, BinaryFormat, FileSink>>(L"app.bin", config)
+    template <class OutputT, class Target>
+    void addOutput(Target&& target, const OutputConfig& config = OutputConfig())
+    {
+        auto& log = getInstance();
+        auto c = log.makeConfig(config);
+        log.addOutput(unique_ptr<Output>(new OutputT(std::forward<Target>(target), c)), c);
+    }
+
+    // One entry per output with durability, in the order they were added.
+    inline vector<DurabilityStats> durabilityStats() { return getInstance().durabilityStats(); }
+
+    // One entry per fairQueueing output, in the order they were added.
+    inline vector<vector<ProducerStats>> producerStats() { return getInstance().producerStats(); }
+
+    inline vector<SiteStats> siteStats(size_t topN = 10) { return getInstance().siteStats(topN); }
+
+    inline void siteReport(wostream& os, size_t topN = 10)
+    {
+        os << "messages       bytes  site" << endl;
+        for (auto& st : siteStats(topN)) {
+            os << setw(8) << st.messages << setw(12) << st.bytes << "  " << baseName(st.file) << ":"
+               << st.line << endl;
+        }
+    }
+
+#if !defined(LOGGY_SEPARATE_COMPILATION) || defined(LOGGY_IMPLEMENTATION)
+    LOGGY_API void resetOutput() { getInstance().resetOutput(); }
 
-    void addOutput(const wstring& path, int level = LDEBUG, int bufferSize = DEFAULT_BUF_CNT)
+    LOGGY_API void addOutput(const wstring& path, int level, int bufferSize)
     {
         getInstance().addOutput(path, level, bufferSize);
     }
 
-    void addOutput(wostream& stream, int level = LDEBUG, int bufferSize = DEFAULT_BUF_CNT)
+    LOGGY_API void addOutput(wostream& stream, int level, int bufferSize)
     {
         getInstance().addOutput(stream, level, bufferSize);
     }
 
-    void setTrigger(int levelFrom, int levelTo, int lookbackCount)
+    LOGGY_API void addOutput(const wstring& path, const OutputConfig& config)
     {
-        getInstance().setTrigger(levelFrom, levelTo, lookbackCount);
+        getInstance().addOutput(path, config);
+    }
+
+    LOGGY_API void addOutput(wostream& stream, const OutputConfig& config)
+    {
+        getInstance().addOutput(stream, config);
     }
 
-    std::vector<const char*> getFiles() { return getInstance().getFiles(); }
+    LOGGY_API void setName(const string& name) { getInstance().setName(name); }
+
+    LOGGY_API void setTrigger(int levelFrom, int levelTo, int lookbackCount)
+    {
+        getInstance().setTrigger(levelFrom, levelTo, lookbackCount);
+    }
 
-    void setLevel(int level) { getInstance().setLevel(level); }
+    LOGGY_API std::vector<const char*> getFiles() { return getInstance().getFiles(); }
 
-    bool isLevel(int level) { return getInstance().isLevel(level); }
+    LOGGY_API void setLevel(int level) { getInstance().setLevel(level); }
 
-    wostream& writer(int level, const char* file, int line)
+    LOGGY_API wostream& writer(int level, const char* file, int line)
     {
         return getInstance().writer(level, file, line);
     }
 
-    void queue() { getInstance().queue(); }
+    LOGGY_API void queue() { getInstance().queue(); }
+
+    LOGGY_API void wait_queues() { getInstance().wait_queues(); }
+
+    LOGGY_API void prepareThread(size_t reserve) { getInstance().prepareThread(reserve); }
+
+    // Call before installing handlers that log: constructs the logger, which a handler must
+    // never do, and makes the output threads poll for signal records.
+    LOGGY_API void enableSignalLogging() { getInstance().enableSignalLogging(); }
+
+    LOGGY_API bool signalLogging()
+    {
+        return getInstance().signalLogging_.load(memory_order_relaxed);
+    }
+
+    LOGGY_API void drainSignals() { getInstance().drainSignals(); }
+
+    LOGGY_API bool signalLog(int level, const char* file, int line, const char* msg)
+    {
+        auto& log = getInstance();
+        return log.isSignalLevel(level) && log.signals_.push(level, file, line, msg, nullptr);
+    }
+
+    LOGGY_API bool signalLog(int level, const char* file, int line, const char* msg, long long value)
+    {
+        auto& log = getInstance();
+        return log.isSignalLevel(level) && log.signals_.push(level, file, line, msg, &value);
+    }
+
+    LOGGY_API bool enableSharedStats(const string& name)
+    {
+        return getInstance().enableSharedStats(name);
+    }
+
+    LOGGY_API bool enableControlSocket(const string& path)
+    {
+        return getInstance().enableControlSocket(path);
+    }
+
+    LOGGY_API string control(const string& command) { return getInstance().command(command); }
+
+    LOGGY_API void setSiteProfiling(bool enable) { getInstance().setSiteProfiling(enable); }
+
+    LOGGY_API void setSiteReport(double seconds, size_t topN)
+    {
+        getInstance().setSiteReport(seconds, topN);
+    }
+
+    LOGGY_API void resetSiteStats() { getInstance().resetSiteStats(); }
+
+    LOGGY_API void setGovernor(bool enable, double highWater, double lowWater)
+    {
+        getInstance().setGovernor(enable, highWater, lowWater);
+    }
+
+    LOGGY_API void setStackTraces(int level, size_t depth)
+    {
+        getInstance().setStackTraces(level, depth);
+    }
+
+    // In a statement, copies the bytes for the output thread to encode; anywhere else,
+    // writes the hex digits now.
+    LOGGY_API wostream& operator<<(wostream& os, const Blob& blob)
+    {
+        auto& ll = Log::lastLog();
+        if (&os != &ll.ws) {
+            wstring hex;
+            appendHexBytes(hex, blob.data, blob.size);
+            return os << hex;
+        }
+        if (os) {
+            size_t kept = (std::min)(blob.size, BLOB_MAX_BYTES);
+            ll.blobs.push_back({ (size_t)ll.ws.tellp(), kept, blob.size });
+            ll.blob.append((const char*)blob.data, kept);
+        }
+        return os;
+    }
+
+    LOGGY_API void stat(const char* name, double value, const char* file, int line)
+    {
+        Record r;
+        r.kind = REC_STAT;
+        r.ns = nowNs();
+        r.name = name;
+        r.value = value;
+        r.file = file;
+        r.line = line;
+        r.tid = threadId();
+        getInstance().push(r);
+    }
+
+    LOGGY_API void endSpan(const char* name, const char* file, int line, int64_t begin)
+    {
+        Record r;
+        r.kind = REC_SPAN;
+        r.ns = begin;
+        r.dur = nowNs() - begin;
+        r.name = name;
+        r.file = file;
+        r.line = line;
+        r.tid = threadId();
+        getInstance().push(r);
+    }
+
+    LOGGY_API RequestScope::RequestScope(int captureLevel, chrono::nanoseconds slow, size_t maxRecords)
+        : buffer_(new RequestBuffer)
+        , start_(chrono::steady_clock::now())
+        , slow_(slow)
+        , exceptions_(uncaught_exceptions())
+    {
+        auto& current = Log::requestBuffer();
+        buffer_->outer = current;
+        buffer_->floor = captureLevel;
+        buffer_->max = maxRecords;
+        current = buffer_.get();
+        captureFloor_ = captureLevel;
+    }
+
+    LOGGY_API RequestScope::~RequestScope()
+    {
+        auto& buffer = *buffer_;
+        Log::requestBuffer() = buffer.outer;
+        captureFloor_ = buffer.outer ? buffer.outer->floor : LMAX + 1;
+        bool failed = failed_ || uncaught_exceptions() > exceptions_
+            || (slow_.count() && chrono::steady_clock::now() - start_ >= slow_);
 
-    void wait_queues() { getInstance().wait_queues(); }
+        if (failed) {
+            auto& log = getInstance();
+            if (buffer.discarded) {
+                Record r;
+                r.level = LINFO;
+                r.ns = buffer.records.empty() ? nowNs() : buffer.records.front().ns;
+                r.file = __FILE__;
+                r.line = __LINE__;
+                r.tid = threadId();
+                wstringstream ws;
+                ws << "request scope discarded " << buffer.discarded << " earlier records";
+                r.msg = ws.str();
+                log.push(r);
+            }
+            for (auto& r : buffer.records) {
+                log.push(r);
+            }
+        }
+        else if (buffer.outer) {
+            for (auto& r : buffer.records) {
+                buffer.outer->add(std::move(r));
+            }
+        }
+    }
 
-}  // end namespace Loggy
\ No newline at end of file
+    LOGGY_API size_t RequestScope::size() const { return buffer_->records.size(); }
+#endif
+}  // end namespace Loggy
@@ -0,0 +1,18 @@
+// Compiled part of the logger for builds that define LOGGY_SEPARATE_COMPILATION everywhere:
+// logging code includes Loggy.h and links this file instead of inlining Logger.h.
+
+#ifndef LOGGY_SEPARATE_COMPILATION
+#error "Loggy.cpp is for LOGGY_SEPARATE_COMPILATION builds; otherwise include Logger.h only"
+#endif
+
+#define LOGGY_IMPLEMENTATION
+#include "Logger.h"
+
+namespace Loggy {
+    template class BasicOutput<MutexQueue, TextFormat, StreamSink>;
+    template class BasicOutput<MutexQueue, TextFormat, FileSink>;
+    template class BasicOutput<MutexQueue, TraceFormat, FileSink>;
+    template class BasicOutput<MutexQueue, BinaryFormat, FileSink>;
+    template class BasicOutput<MutexQueue, TextFormat, MemorySink>;
+    template class BasicOutput<RingQueue, TextFormat, FileSink>;
+}  // end namespace Loggy
@@ -0,0 +1,293 @@
+#pragma once
+
+// Front end of the logger: the statement macros, levels and configuration.  Logger.h holds
+// the implementation and includes this file.  By default everything is inline and a program
+// includes Logger.h wherever it logs.  With LOGGY_SEPARATE_COMPILATION defined for the whole
+// build, call sites include only this header and Loggy.cpp compiles the logger once.
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#ifdef LOGGY_SEPARATE_COMPILATION
+#define LOGGY_API
+#else
+#define LOGGY_API inline
+#endif
+
+// Keep the enabled path of a statement out of line and out of the caller's hot code.
+#if defined(__GNUC__) || defined(__clang__)
+#define LOGGY_COLD __attribute__((cold))
+#define LOGGY_NOINLINE __attribute__((noinline))
+#elif defined(_MSC_VER)
+#define LOGGY_COLD
+#define LOGGY_NOINLINE __declspec(noinline)
+#else
+#define LOGGY_COLD
+#define LOGGY_NOINLINE
+#endif
+
+#define LOGL(level, msg)                                                                           \
+    if (Loggy::isLevel(level)) {                                                                   \
+        Loggy::writer(level, __FILE__, __LINE__) << msg;                                           \
+        Loggy::queue();                                                                            \
+    }
+
+#define LOG_FLUSH()                                                                                \
+    {                                                                                              \
+        Loggy::wait_queues();                                                                      \
+    }
+
+#define _LOGGY_CONCAT2(a, b) a##b
+#define _LOGGY_CONCAT(a, b) _LOGGY_CONCAT2(a, b)
+
+// Times the enclosing scope for trace outputs; name must be a string literal.
+#define LOG_SCOPE(name)                                                                            \
+    Loggy::Span _LOGGY_CONCAT(_loggy_span_, __COUNTER__)(name, __FILE__, __LINE__)
+
+// Adds a sample to the named metric; outputs aggregate samples and write one summary line
+// per metric and interval.  name must be a string literal.
+#define LOG_STAT(name, value)                                                                      \
+    if (Loggy::isLevel(Loggy::LINFO)) {                                                            \
+        Loggy::stat(name, value, __FILE__, __LINE__);                                              \
+    }
+
+// Usable from signal handlers once Loggy::enableSignalLogging() has run: no locks, no
+// allocation.  msg is a C string, copied up to SIGNAL_MSG_SIZE; value is an integer.
+#define LOG_SIGNAL_SAFE(level, msg) Loggy::signalLog(level, __FILE__, __LINE__, msg)
+#define LOG_SIGNAL_SAFE_VALUE(level, msg, value)                                                   \
+    Loggy::signalLog(level, __FILE__, __LINE__, msg, (long long)(value))
+
+#define LOGT(msg) LOGL(Loggy::LTRACE, msg)
+#define LOGD(msg) LOGL(Loggy::LDEBUG, msg)
+#define LOGI(msg) LOGL(Loggy::LINFO, msg)
+#define LOGE(msg) LOGL(Loggy::LERROR, msg)
+
+namespace Loggy {
+    using namespace std;
+
+    constexpr int DEFAULT_BUF_CNT = 1000;
+    constexpr const char* DEFAULT_TIME_FMT = "%Y%m%d.%H%M%S";
+    constexpr const char* DEFAULT_PATTERN = "%T %F:%L %V %m";
+    constexpr double FLUSH_SECONDS = 1.0;
+    constexpr double STAT_SECONDS = 60.0;
+    constexpr int STAT_BUCKETS = 64;
+    constexpr double GOVERNOR_SECONDS = 1.0;
+    constexpr size_t GOVERNOR_MAX_SITES = 8;
+    constexpr size_t SIGNAL_SLOTS = 64;
+    constexpr size_t SIGNAL_MSG_SIZE = 256;
+    constexpr double SIGNAL_POLL_SECONDS = 0.1;
+    constexpr size_t REQUEST_BUF_CNT = 1000;
+    constexpr size_t RING_SLOTS = 8192;
+    constexpr int RING_SPINS = 64;
+    constexpr size_t FORMAT_BATCH = 1024;
+    constexpr size_t FORMAT_SHARD_MIN = 32;
+    constexpr size_t WRITE_BATCH_BYTES = 64 * 1024;
+    constexpr double SYNC_SECONDS = 1.0;
+    constexpr uint64_t SYNC_GROUP_MAX = 1024;
+    constexpr double FAIR_QUEUE_START = 0.5;
+    constexpr size_t GAP_BLAME_THREADS = 8;
+    constexpr double CONTROL_POLL_SECONDS = 0.2;
+    constexpr double CONTROL_IDLE_SECONDS = 60.0;
+    constexpr size_t CONTROL_LINE_MAX = 4096;
+    constexpr size_t STACK_FRAMES = 32;
+    constexpr size_t BLOB_MAX_BYTES = 64 * 1024;
+    constexpr size_t THREAD_MSG_RESERVE = 1024;
+    constexpr size_t THREAD_STACK_PREFAULT = 64 * 1024;
+
+    enum {
+        LINVALID = 0,
+        LTRACE = 9,
+        LDEBUG = 10,
+        LINFO = 20,
+        LERROR = 40,
+        LWARN = 30,
+        LCRITICAL = 50,
+        LMAX = 50,
+    };
+
+    enum {
+        TS_LOCAL = 0,  // local time, through localtime_r
+        TS_UTC,        // UTC civil time, computed without touching TZ state
+        TS_EPOCH_NS,   // nanoseconds since the epoch
+    };
+
+    enum {
+        FORMAT_TEXT = 0,  // lines rendered through the output's layout
+        FORMAT_TRACE,     // Chrome trace_event JSON (chrome://tracing, Perfetto)
+        FORMAT_BINARY,    // length-prefixed binary records, see BinaryFormat
+    };
+
+    enum {
+        DURABLE_NONE = 0,  // the OS writes the file back when it likes
+        DURABLE_PERIODIC,  // fdatasync every syncSeconds while there is something new
+        DURABLE_ERROR,     // ERROR and CRITICAL statements return once they are on disk
+    };
+
+    struct OutputConfig {
+        int level = LDEBUG;
+        size_t bufferSize = DEFAULT_BUF_CNT;
+        string pattern = DEFAULT_PATTERN;
+        string timeFormat;  // empty: the logger's time format
+        string name;        // empty: the logger's name
+        int timeMode = TS_LOCAL;
+        int format = FORMAT_TEXT;
+        double statSeconds = STAT_SECONDS;  // LOG_STAT summary interval, 0 ignores samples
+        size_t formatThreads = 1;           // threads formatting records, for busy outputs
+        double flushSeconds = FLUSH_SECONDS;  // longest a written record waits to reach the
+                                              // OS; 0 flushes whenever the queue drains
+        int durability = DURABLE_NONE;
+        double syncSeconds = SYNC_SECONDS;  // DURABLE_PERIODIC interval
+        bool fairQueueing = false;  // share a bounded queue between threads, see setThreadWeight()
+    };
+
+    // Read by the statement macros without a call: the logger level, whether a trace output
+    // exists, and the lowest level the innermost RequestScope on this thread captures.
+    inline atomic<int> logLevel_ { LINFO };
+    inline atomic<bool> tracing_ { false };
+    inline thread_local int captureFloor_ = LMAX + 1;
+    inline thread_local unsigned threadWeight_ = 1;
+
+    inline bool isLevel(int level)
+    {
+        return level >= logLevel_.load(memory_order_relaxed)
+            || (level < LINFO && level >= captureFloor_);
+    }
+
+    // This thread's share of fairQueueing outputs relative to other threads; 1 by default.
+    inline void setThreadWeight(unsigned weight) { threadWeight_ = weight ? weight : 1; }
+
+    // True while a trace output is configured, so spans are worth recording.
+    inline bool isTracing() { return tracing_.load(memory_order_relaxed); }
+
+    inline int64_t nowNs()
+    {
+        return chrono::duration_cast<chrono::nanoseconds>(
+            chrono::system_clock::now().time_since_epoch())
+            .count();
+    }
+
+    LOGGY_API void resetOutput();
+    LOGGY_API void addOutput(const wstring& path, int level = LDEBUG, int bufferSize = DEFAULT_BUF_CNT);
+    LOGGY_API void addOutput(wostream& stream, int level = LDEBUG, int bufferSize = DEFAULT_BUF_CNT);
+    LOGGY_API void addOutput(const wstring& path, const OutputConfig& config);
+    LOGGY_API void addOutput(wostream& stream, const OutputConfig& config);
+    LOGGY_API void setName(const string& name);
+    LOGGY_API void setTrigger(int levelFrom, int levelTo, int lookbackCount);
+    LOGGY_API std::vector<const char*> getFiles();
+    LOGGY_API void setLevel(int level);
+    LOGGY_API void wait_queues();
+
+    // Call once at the start of a latency-sensitive thread, so its first statement does not
+    // pay for creating the thread's logging state.  reserve is the message length, in
+    // characters, that statements can format without growing their buffer.
+    LOGGY_API void prepareThread(size_t reserve = THREAD_MSG_RESERVE);
+
+    LOGGY_COLD LOGGY_API wostream& writer(int level, const char* file, int line);
+    LOGGY_COLD LOGGY_API void queue();
+    LOGGY_COLD LOGGY_API void stat(const char* name, double value, const char* file, int line);
+    LOGGY_COLD LOGGY_API void endSpan(const char* name, const char* file, int line, int64_t begin);
+
+    LOGGY_API void enableSignalLogging();
+    LOGGY_API bool signalLogging();
+    LOGGY_API void drainSignals();
+    LOGGY_API bool signalLog(int level, const char* file, int line, const char* msg);
+    LOGGY_API bool signalLog(int level, const char* file, int line, const char* msg, long long value);
+
+    LOGGY_API void setSiteProfiling(bool enable);
+    LOGGY_API void setSiteReport(double seconds, size_t topN = 10);
+    LOGGY_API void resetSiteStats();
+    LOGGY_API void setGovernor(bool enable, double highWater = 0.75, double lowWater = 0.25);
+
+    // Statements at level and above carry up to depth return addresses of their stack, which
+    // the outputs resolve to function names on their own threads; the statement only pays
+    // for the capture.  LMAX + 1 turns it off, the default.  Names come from the dynamic
+    // symbol table, so link with -rdynamic to see the program's own functions.
+    LOGGY_API void setStackTraces(int level = LCRITICAL, size_t depth = STACK_FRAMES);
+
+    // Publishes each output's counters in the shared-memory segment name (default
+    // /loggy-<pid>) for loggy-top to display.  The output threads keep it up to date, so
+    // producers pay nothing.  False where POSIX shared memory is unavailable.
+    LOGGY_API bool enableSharedStats(const string& name = string());
+
+    // Serves control commands on a Unix domain socket, by default /tmp/loggy-<pid>.sock with
+    // mode 0600, from a thread of its own:
+    //   echo "level DEBUG */net/*" | nc -U /tmp/loggy-1234.sock
+    // "help" lists the commands.  False where Unix domain sockets are unavailable.
+    LOGGY_API bool enableControlSocket(const string& path = string());
+
+    // Runs one control command in-process and returns the reply.
+    LOGGY_API string control(const string& command);
+
+    // A byte buffer for a statement, e.g. LOGD("rx " << Loggy::hexdump(buf, n)).  The
+    // statement copies up to BLOB_MAX_BYTES of it; text outputs write them as hex digits,
+    // binary outputs as they are.
+    struct Blob {
+        const void* data;
+        size_t size;
+    };
+
+    inline Blob hexdump(const void* data, size_t size) { return Blob { data, size }; }
+
+    LOGGY_API wostream& operator<<(wostream& os, const Blob& blob);
+
+    // RAII timing span behind LOG_SCOPE.  Costs a relaxed load when no trace output exists.
+    class Span {
+    public:
+        Span(const char* name, const char* file, int line)
+            : name_(name)
+            , file_(file)
+            , line_(line)
+            , begin_(isTracing() ? nowNs() : 0)
+        {
+        }
+
+        Span(const Span&) = delete;
+        Span& operator=(const Span&) = delete;
+
+        ~Span()
+        {
+            if (begin_) {
+                endSpan(name_, file_, line_, begin_);
+            }
+        }
+
+    private:
+        const char* name_;
+        const char* file_;
+        int line_;
+        int64_t begin_;
+    };
+
+    struct RequestBuffer;
+
+    // Buffers this thread's DEBUG and TRACE statements for the lifetime of the scope, even
+    // when the logger level would discard them.  On exit they are dropped if the request went
+    // fine, or handed to the outputs in order if fail() was called, an exception is unwinding
+    // through the scope, or it lasted longer than slow (if nonzero).  A succeeding nested
+    // scope passes its records on to the enclosing one.
+    class RequestScope {
+    public:
+        LOGGY_API RequestScope(int captureLevel = LDEBUG,
+            chrono::nanoseconds slow = chrono::nanoseconds(0), size_t maxRecords = REQUEST_BUF_CNT);
+
+        RequestScope(const RequestScope&) = delete;
+        RequestScope& operator=(const RequestScope&) = delete;
+
+        LOGGY_API ~RequestScope();
+
+        void fail() { failed_ = true; }
+
+        LOGGY_API size_t size() const;
+
+    private:
+        unique_ptr<RequestBuffer> buffer_;
+        chrono::steady_clock::time_point start_;
+        chrono::nanoseconds slow_;
+        int exceptions_;
+        bool failed_ = false;
+    };
+}  // end namespace Loggy
@@ -0,0 +1,60 @@
+#pragma once
+
+// Layout of the shared-memory segment a process publishes its logger counters in, see
+// Loggy::enableSharedStats().  Written only by the output threads and read by loggy-top,
+// so it holds plain counters and no pointers.  Bump STATS_VERSION on any change.
+
+#include <atomic>
+#include <cstdint>
+
+namespace Loggy {
+    constexpr uint32_t STATS_MAGIC = 0x59474f4c;  // "LOGY"
+    constexpr uint32_t STATS_VERSION = 1;
+    constexpr size_t STATS_OUTPUTS = 16;
+    constexpr size_t STATS_NAME_SIZE = 112;
+    constexpr double STATS_PUBLISH_SECONDS = 1.0;
+
+    enum {
+        STATS_TRACE = 0,
+        STATS_DEBUG,
+        STATS_INFO,
+        STATS_WARN,
+        STATS_ERROR,
+        STATS_CRITICAL,
+        STATS_LEVELS,
+    };
+
+    struct SharedOutputStats {
+        char name[STATS_NAME_SIZE];  // the file, or "stream" / "memory"
+        std::atomic<uint64_t> capacity;  // queue bound, 0 unbounded
+        std::atomic<uint64_t> depth;     // records waiting
+        std::atomic<uint64_t> queued;    // records queued, in total
+        std::atomic<uint64_t> written;   // records written, in total
+        std::atomic<uint64_t> dropped;   // records dropped, in total
+        std::atomic<uint64_t> levels[STATS_LEVELS];  // log statements written, by level
+        // time from the statement to its write, over the last STATS_PUBLISH_SECONDS with
+        // writes; bucket upper bounds in nanoseconds
+        std::atomic<uint64_t> latencyP50Ns;
+        std::atomic<uint64_t> latencyP99Ns;
+        std::atomic<uint64_t> latencyMaxNs;
+        std::atomic<int64_t> updatedNs;  // system clock
+    };
+
+    struct SharedStats {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t pid;
+        std::atomic<uint32_t> outputs;  // slots in use
+        SharedOutputStats output[STATS_OUTPUTS];
+    };
+
+    inline int statsLevel(int level)
+    {
+        return level >= 50 ? STATS_CRITICAL
+            : level >= 40  ? STATS_ERROR
+            : level >= 30  ? STATS_WARN
+            : level >= 20  ? STATS_INFO
+            : level >= 10  ? STATS_DEBUG
+                           : STATS_TRACE;
+    }
+}  // end namespace Loggy
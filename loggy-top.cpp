@@ -0,0 +1,188 @@
+// loggy-top: live view of the logger counters a process publishes with
+// Loggy::enableSharedStats().  Attaches to the segment read-only, so the process being
+// watched does no extra work.
+//
+//   loggy-top                      lists the processes publishing under /dev/shm
+//   loggy-top <pid|name> [seconds] shows one, refreshed every seconds (default 1)
+//
+// Build: g++ -std=c++17 -O2 loggy-top.cpp -o loggy-top  (add -lrt before glibc 2.34)
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+
+#include "LoggyStats.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace Loggy {
+    using namespace std;
+
+    static const char* levelLabels_[STATS_LEVELS] = { "T", "D", "I", "W", "E", "C" };
+
+    static bool alive(uint64_t pid) { return kill((pid_t)pid, 0) == 0 || errno == EPERM; }
+
+    static const SharedStats* attach(const string& name)
+    {
+        int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0) {
+            return nullptr;
+        }
+        void* p = mmap(nullptr, sizeof(SharedStats), PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) {
+            return nullptr;
+        }
+        auto stats = static_cast<const SharedStats*>(p);
+        if (stats->magic != STATS_MAGIC || stats->version != STATS_VERSION) {
+            munmap(p, sizeof(SharedStats));
+            return nullptr;
+        }
+        return stats;
+    }
+
+    static int list()
+    {
+        DIR* d = opendir("/dev/shm");
+        if (!d) {
+            fprintf(stderr, "loggy-top: cannot list /dev/shm; pass a pid or segment name\n");
+            return 1;
+        }
+        printf("%8s  %7s  %s\n", "pid", "outputs", "segment");
+        while (auto e = readdir(d)) {
+            if (strncmp(e->d_name, "loggy-", 6) != 0) {
+                continue;
+            }
+            string name = string("/") + e->d_name;
+            if (auto s = attach(name)) {
+                if (alive(s->pid)) {
+                    printf("%8llu  %7u  %s\n", (unsigned long long)s->pid, s->outputs.load(),
+                        name.c_str());
+                }
+                munmap((void*)s, sizeof(SharedStats));
+            }
+        }
+        closedir(d);
+        return 0;
+    }
+
+    static string duration(uint64_t ns)
+    {
+        char buf[32];
+        if (ns < 10000) {
+            snprintf(buf, sizeof(buf), "%lluns", (unsigned long long)ns);
+        }
+        else if (ns < 10000000) {
+            snprintf(buf, sizeof(buf), "%.0fus", ns / 1e3);
+        }
+        else if (ns < 10000000000ull) {
+            snprintf(buf, sizeof(buf), "%.0fms", ns / 1e6);
+        }
+        else {
+            snprintf(buf, sizeof(buf), "%.0fs", ns / 1e9);
+        }
+        return buf;
+    }
+
+    struct Previous {
+        uint64_t queued = 0;
+        uint64_t written = 0;
+        uint64_t dropped = 0;
+        uint64_t levels[STATS_LEVELS] = {};
+    };
+
+    static int top(const SharedStats& s, double seconds)
+    {
+        Previous prev[STATS_OUTPUTS];
+        auto last = chrono::steady_clock::now();
+        for (bool first = true;; first = false) {
+            auto now = chrono::steady_clock::now();
+            double dt = chrono::duration<double>(now - last).count();
+            last = now;
+            auto rate = [&](uint64_t cur, uint64_t& prev) {
+                double r = first || dt <= 0 || cur < prev ? 0 : (cur - prev) / dt;
+                prev = cur;
+                return r;
+            };
+
+            printf("\x1b[H\x1b[2J");
+            printf("loggy-top  pid %llu  %u outputs  every %gs\n\n", (unsigned long long)s.pid,
+                s.outputs.load(), seconds);
+            printf("%-32s %11s %9s %9s %9s", "output", "depth/cap", "queued/s", "written/s",
+                "dropped/s");
+            for (int l = 0; l < STATS_LEVELS; ++l) {
+                printf(" %7s/s", levelLabels_[l]);
+            }
+            printf(" %7s %7s %7s %8s\n", "p50", "p99", "max", "dropped");
+
+            auto wall = chrono::duration_cast<chrono::nanoseconds>(
+                chrono::system_clock::now().time_since_epoch())
+                            .count();
+            for (uint32_t i = 0; i < s.outputs.load() && i < STATS_OUTPUTS; ++i) {
+                auto& o = s.output[i];
+                auto& p = prev[i];
+                string name(o.name, strnlen(o.name, sizeof(o.name)));
+                if (name.size() > 32) {
+                    name = "..." + name.substr(name.size() - 29);
+                }
+                char depth[32];
+                if (o.capacity) {
+                    snprintf(depth, sizeof(depth), "%llu/%llu", (unsigned long long)o.depth.load(),
+                        (unsigned long long)o.capacity.load());
+                }
+                else {
+                    snprintf(depth, sizeof(depth), "%llu", (unsigned long long)o.depth.load());
+                }
+                printf("%-32s %11s %9.0f %9.0f %9.0f", name.c_str(), depth, rate(o.queued, p.queued),
+                    rate(o.written, p.written), rate(o.dropped, p.dropped));
+                for (int l = 0; l < STATS_LEVELS; ++l) {
+                    printf(" %9.0f", rate(o.levels[l], p.levels[l]));
+                }
+                auto updated = o.updatedNs.load(memory_order_acquire);
+                printf(" %7s %7s %7s %8llu%s\n", duration(o.latencyP50Ns).c_str(),
+                    duration(o.latencyP99Ns).c_str(), duration(o.latencyMaxNs).c_str(),
+                    (unsigned long long)o.dropped.load(),
+                    updated && wall - updated > 10e9 ? "  (idle)" : "");
+            }
+            fflush(stdout);
+
+            if (!alive(s.pid)) {
+                printf("\nprocess %llu has exited\n", (unsigned long long)s.pid);
+                return 0;
+            }
+            this_thread::sleep_for(chrono::duration<double>(seconds));
+        }
+    }
+}  // end namespace Loggy
+
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        return Loggy::list();
+    }
+    std::string name = argv[1];
+    if (name.find_first_not_of("0123456789") == std::string::npos) {
+        name = "/loggy-" + name;
+    }
+    else if (name[0] != '/') {
+        name = "/" + name;
+    }
+    double seconds = argc > 2 ? atof(argv[2]) : 1.0;
+    if (!(seconds > 0)) {
+        seconds = 1.0;
+    }
+    auto stats = Loggy::attach(name);
+    if (!stats) {
+        fprintf(stderr, "loggy-top: no logger stats at %s\n", name.c_str());
+        return 1;
+    }
+    return Loggy::top(*stats, seconds);
+}